@@ -1,6 +1,9 @@
 #include <map>
+#include <deque>
+#include <regex>
 #include <iostream>
 #include <thread>
+#include <condition_variable>
 
 #include <nix/config.h>
 #include <nix/args.hh>
@@ -15,16 +18,32 @@
 #include <nix/flake/flakeref.hh>
 #include <nix/flake/flake.hh>
 #include <nix/attr-path.hh>
+#include <nix/eval-cache.hh>
 #include <nix/derivations.hh>
 #include <nix/local-store.hh>
+#include <nix/remote-store.hh>
 #include <nix/logging.hh>
 #include <nix/error.hh>
 
 #include <nix/value-to-json.hh>
+#include <nix/sqlite.hh>
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+
+#if __APPLE__
+#include <sys/param.h>
+#include <mach/mach.h>
+#endif
+
+#if HAVE_BOEHMGC
+#include <gc/gc.h>
+#endif
 
 #include <nlohmann/json.hpp>
 
@@ -32,15 +51,62 @@ using namespace nix;
 
 typedef enum { evalAuto, evalImpure, evalPure } pureEval;
 
+enum class OutputFormat { Json, Cbor, Msgpack };
+
+/* Split an attribute path into its names at the dots that are not
+   quoted, like the selection paths of `nix-build -A'. Nix only
+   exports a variant that needs an EvalState, which the master does
+   not have. */
+static std::vector<std::string> splitAttrPath(std::string_view s)
+{
+    std::vector<std::string> res;
+    std::string cur;
+    auto i = s.begin();
+    while (i != s.end()) {
+        if (*i == '.') {
+            res.push_back(cur);
+            cur.clear();
+        } else if (*i == '"') {
+            ++i;
+            while (true) {
+                if (i == s.end())
+                    throw UsageError("missing closing quote in attribute path '%1%'", s);
+                if (*i == '"') break;
+                cur.push_back(*i++);
+            }
+        } else
+            cur.push_back(*i);
+        ++i;
+    }
+    if (!cur.empty()) res.push_back(cur);
+    return res;
+}
+
 struct MyArgs : MixEvalArgs, MixCommonArgs
 {
     Path releaseExpr;
     Path gcRootsDir;
+    Path costFile;
+    Path outputDb;
+    std::optional<std::regex> affinityKey;
     bool flake = false;
     bool meta = false;
     bool showTrace = false;
+    bool resultCache = false;
+    bool evalCacheLookup = false;
     size_t nrWorkers = 1;
     size_t maxMemorySize = 4096;
+    size_t softMemorySize = 0;
+    size_t maxBatchSize = 16;
+    size_t timeoutPerAttr = 0;
+    size_t shardIndex = 0;
+    size_t shardCount = 1;
+    std::vector<std::vector<std::string>> includeAttrs;
+    std::vector<std::vector<std::string>> excludeAttrs;
+    std::optional<std::set<std::string>> fields;
+    std::optional<StringSet> metaKeys;
+    OutputFormat outputFormat = OutputFormat::Json;
+    bool forceGc = false;
     pureEval evalMode = evalAuto;
 
     MyArgs() : MixCommonArgs("nix-eval-jobs")
@@ -75,6 +141,57 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             .handler = {&gcRootsDir}
         });
 
+        addFlag({
+            .longName = "cost-file",
+            .description = "file recording the cost of every job, to start the most expensive ones first",
+            .labels = {"path"},
+            .handler = {&costFile}
+        });
+
+        addFlag({
+            .longName = "affinity-key",
+            .description = "regular expression whose first match in an attribute path groups jobs to hand to the same worker",
+            .labels = {"regex"},
+            .handler = {[=](std::string s) {
+                affinityKey = std::regex(s, std::regex::extended);
+            }}
+        });
+
+        addFlag({
+            .longName = "include-attr",
+            .description = "only evaluate the jobs whose attribute path matches the glob",
+            .labels = {"glob"},
+            .handler = {[=](std::string s) {
+                includeAttrs.push_back(splitAttrPath(s));
+            }}
+        });
+
+        addFlag({
+            .longName = "exclude-attr",
+            .description = "skip the jobs whose attribute path matches the glob",
+            .labels = {"glob"},
+            .handler = {[=](std::string s) {
+                excludeAttrs.push_back(splitAttrPath(s));
+            }}
+        });
+
+        addFlag({
+            .longName = "shard",
+            .description = "only evaluate the jobs of shard I out of N, counting from 1",
+            .labels = {"I/N"},
+            .handler = {[=](std::string s) {
+                auto slash = s.find('/');
+                if (slash == std::string::npos)
+                    throw UsageError("'--shard' expects I/N, got '%s'", s);
+                auto i = std::stoi(s.substr(0, slash));
+                auto n = std::stoi(s.substr(slash + 1));
+                if (n < 1 || i < 1 || i > n)
+                    throw UsageError("'--shard' expects 1 <= I <= N, got '%s'", s);
+                shardIndex = i - 1;
+                shardCount = n;
+            }}
+        });
+
         addFlag({
             .longName = "workers",
             .description = "number of evaluate workers",
@@ -93,6 +210,39 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             }}
         });
 
+        addFlag({
+            .longName = "soft-memory-size",
+            .description = "evaluation memory size above which workers are restarted if their live heap is as large",
+            .labels = {"size"},
+            .handler = {[=](std::string s) {
+                softMemorySize = std::stoi(s);
+            }}
+        });
+
+        addFlag({
+            .longName = "max-batch-size",
+            .description = "maximum number of jobs handed to a worker at once",
+            .labels = {"jobs"},
+            .handler = {[=](std::string s) {
+                maxBatchSize = std::max(std::stoi(s), 1);
+            }}
+        });
+
+        addFlag({
+            .longName = "timeout-per-attr",
+            .description = "seconds after which the evaluation of a job is aborted",
+            .labels = {"seconds"},
+            .handler = {[=](std::string s) {
+                timeoutPerAttr = std::stoi(s);
+            }}
+        });
+
+        addFlag({
+            .longName = "force-gc",
+            .description = "collect garbage before checking the live heap against the soft memory size",
+            .handler = {&forceGc, true}
+        });
+
         addFlag({
             .longName = "flake",
             .description = "build a flake",
@@ -105,6 +255,66 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             .handler = {&meta, true}
         });
 
+        addFlag({
+            .longName = "meta-keys",
+            .description = "comma-separated meta attributes to output instead of all of them",
+            .labels = {"keys"},
+            .handler = {[=](std::string s) {
+                metaKeys = tokenizeString<StringSet>(s, ",");
+                meta = true;
+            }}
+        });
+
+        addFlag({
+            .longName = "output-format",
+            .description = "json for JSON lines, or cbor or msgpack for records each preceded by their 32-bit big-endian length",
+            .labels = {"format"},
+            .handler = {[=](std::string s) {
+                if (s == "json")
+                    outputFormat = OutputFormat::Json;
+                else if (s == "cbor")
+                    outputFormat = OutputFormat::Cbor;
+                else if (s == "msgpack")
+                    outputFormat = OutputFormat::Msgpack;
+                else
+                    throw UsageError("unknown output format '%s'", s);
+            }}
+        });
+
+        addFlag({
+            .longName = "output-db",
+            .description = "SQLite database to write the results to as well, replacing those of earlier runs",
+            .labels = {"path"},
+            .handler = {&outputDb}
+        });
+
+        addFlag({
+            .longName = "fields",
+            .description = "comma-separated fields of the derivations to output, of name, system, drvPath, outputs and meta",
+            .labels = {"fields"},
+            .handler = {[=](std::string s) {
+                static const std::set<std::string> known = {"name", "system", "drvPath", "outputs", "meta"};
+                fields.emplace();
+                for (auto & field : tokenizeString<std::vector<std::string>>(s, ",")) {
+                    if (!known.count(field))
+                        throw UsageError("unknown field '%s'", field);
+                    fields->insert(field);
+                }
+            }}
+        });
+
+        addFlag({
+            .longName = "eval-cache-lookup",
+            .description = "look up the derivations of flakes in the Nix evaluation cache",
+            .handler = {&evalCacheLookup, true}
+        });
+
+        addFlag({
+            .longName = "result-cache",
+            .description = "replay the results of jobs of an unchanged flake from previous runs",
+            .handler = {&resultCache, true}
+        });
+
         addFlag({
             .longName = "show-trace",
             .description = "print out a stack trace in case of evaluation errors",
@@ -117,6 +327,10 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
 
 static MyArgs myArgs;
 
+/* How much output may be buffered before the master waits for the
+   consumer of stdout. */
+static constexpr size_t outputBufferSize = 16 * 1024 * 1024;
+
 static Value* releaseExprTopLevelValue(EvalState & state, Bindings & autoArgs) {
     Value vTop;
 
@@ -129,407 +343,2438 @@ static Value* releaseExprTopLevelValue(EvalState & state, Bindings & autoArgs) {
     return vRoot;
 }
 
-static nlohmann::json response(std::string & attrName) {
-    nlohmann::json reply;
-    reply["attr"] = attrName;
-    return reply;
+/* What the workers need to know about the flake being evaluated to
+   use its evaluation cache. */
+struct FlakeInfo
+{
+    std::optional<Hash> fingerprint;
+    Value * outputs = nullptr;
+    std::string fragment;
+};
+
+static flake::LockedFlake lockJobsFlake(EvalState & state) {
+    using namespace flake;
+
+    auto [flakeRef, fragment] = parseFlakeRefWithFragment(myArgs.releaseExpr, absPath("."));
+
+    return lockFlake(state, flakeRef,
+        LockFlags {
+            .updateLockFile = false,
+            .useRegistries = false,
+            .allowMutable = false,
+        });
 }
 
-static void worker(
-    EvalState & state,
-    Bindings & autoArgs,
-    AutoCloseFD & to,
-    AutoCloseFD & from,
-    const Path &gcRootsDir)
+/* Serialise the lock of the flake for the workers that do not
+   inherit it, so that they can call the flake without locking it
+   again. */
+static nlohmann::json lockedFlakeToJSON(const flake::LockedFlake & lockedFlake)
 {
-    Value vTop;
-    Value * vRoot;
+    auto & flake = lockedFlake.flake;
+
+    nlohmann::json json;
+    json["lockedRef"] = fetchers::attrsToJSON(flake.lockedRef.input.toAttrs());
+    json["subdir"] = flake.lockedRef.subdir;
+    json["forceDirty"] = flake.forceDirty;
+    json["actualPath"] = flake.sourceInfo->actualPath;
+    json["storePath"] = std::string(flake.sourceInfo->storePath.to_string());
+    json["lockFile"] = lockedFlake.lockFile.toJSON();
+    return json;
+}
 
-    if (myArgs.flake) {
-        using namespace flake;
+/* The inverse of lockedFlakeToJSON(), with everything callFlake()
+   needs. The flake's own source is already in the store. */
+static flake::LockedFlake lockedFlakeFromJSON(const nlohmann::json & json)
+{
+    using namespace flake;
+
+    FlakeRef lockedRef(
+        fetchers::Input::fromAttrs(fetchers::jsonToAttrs(json["lockedRef"])),
+        json["subdir"].get<std::string>());
+
+    return LockedFlake {
+        .flake = Flake {
+            .originalRef = lockedRef,
+            .resolvedRef = lockedRef,
+            .lockedRef = lockedRef,
+            .forceDirty = json["forceDirty"].get<bool>(),
+            .sourceInfo = std::make_shared<fetchers::Tree>(fetchers::Tree {
+                .actualPath = json["actualPath"].get<std::string>(),
+                .storePath = StorePath(json["storePath"].get<std::string>()),
+            }),
+        },
+        .lockFile = LockFile(json["lockFile"], "flake.lock"),
+    };
+}
 
-        auto [flakeRef, fragment] = parseFlakeRefWithFragment(myArgs.releaseExpr, absPath("."));
+static Value* flakeTopLevelValue(
+    EvalState & state,
+    Bindings & autoArgs,
+    const flake::LockedFlake & lockedFlake,
+    FlakeInfo & flakeInfo)
+{
+    using namespace flake;
 
-        auto vFlake = state.allocValue();
+    Value vTop;
 
-        auto lockedFlake = lockFlake(state, flakeRef,
-            LockFlags {
-                .updateLockFile = false,
-                .useRegistries = false,
-                .allowMutable = false,
-            });
+    auto [flakeRef, fragment] = parseFlakeRefWithFragment(myArgs.releaseExpr, absPath("."));
 
-        callFlake(state, lockedFlake, *vFlake);
+    auto vFlake = state.allocValue();
 
-        auto vOutputs = vFlake->attrs->get(state.symbols.create("outputs"))->value;
-        state.forceValue(*vOutputs, noPos);
-        vTop = *vOutputs;
+    flakeInfo.fingerprint = lockedFlake.getFingerprint();
+    flakeInfo.fragment = fragment;
 
-        if (fragment.length() > 0) {
-            Bindings & bindings(*state.allocBindings(0));
-            auto [nTop, pos] = findAlongAttrPath(state, fragment, bindings, vTop);
-            if (!nTop)
-                throw Error("error: attribute '%s' missing", nTop);
-            vTop = *nTop;
-        }
+    callFlake(state, lockedFlake, *vFlake);
 
-        vRoot = state.allocValue();
-        state.autoCallFunction(autoArgs, vTop, *vRoot);
+    auto vOutputs = vFlake->attrs->get(state.symbols.create("outputs"))->value;
+    state.forceValue(*vOutputs, noPos);
+    vTop = *vOutputs;
+    flakeInfo.outputs = vOutputs;
 
-    } else {
-        vRoot = releaseExprTopLevelValue(state, autoArgs);
+    if (fragment.length() > 0) {
+        Bindings & bindings(*state.allocBindings(0));
+        auto [nTop, pos] = findAlongAttrPath(state, fragment, bindings, vTop);
+        if (!nTop)
+            throw Error("error: attribute '%s' missing", nTop);
+        vTop = *nTop;
     }
 
+    auto vRoot = state.allocValue();
+    state.autoCallFunction(autoArgs, vTop, *vRoot);
 
-    while (true) {
-        /* Wait for the master to send us a job name. */
-        writeLine(to.get(), "next");
+    return vRoot;
+}
 
-        auto s = readLine(from.get());
-        if (s == "exit") break;
-        if (!hasPrefix(s, "do ")) abort();
-        std::string attrName(s, 3);
+/* Evaluate the root of the jobs, from `lockedFlake' if we evaluate a
+   flake, in which case `flakeInfo' is filled in as well. */
+static Value* topLevelValue(
+    EvalState & state,
+    Bindings & autoArgs,
+    const std::optional<flake::LockedFlake> & lockedFlake,
+    FlakeInfo & flakeInfo)
+{
+    return lockedFlake
+        ? flakeTopLevelValue(state, autoArgs, *lockedFlake, flakeInfo)
+        : releaseExprTopLevelValue(state, autoArgs);
+}
 
-        debug("worker process %d at '%s'", getpid(), attrName);
+static nlohmann::json response(std::string & attrPath) {
+    nlohmann::json reply;
+    reply["attr"] = attrPath;
+    return reply;
+}
 
-        /* Evaluate it and send info back to the master. */
-        try {
-            auto v = state.allocValue();
+/* Serialise the output record `record' in the output format. */
+static std::string encodeRecord(const nlohmann::json & record)
+{
+    std::string s;
+    switch (myArgs.outputFormat) {
+    case OutputFormat::Cbor:
+        nlohmann::json::to_cbor(record, s);
+        break;
+    case OutputFormat::Msgpack:
+        nlohmann::json::to_msgpack(record, s);
+        break;
+    default:
+        s = record.dump();
+    }
+    return s;
+}
 
-            state.autoCallFunction(autoArgs, *vRoot, *v);
-            state.forceValue(*v);
+/* The inverse of encodeRecord(). */
+static nlohmann::json decodeRecord(std::string_view record)
+{
+    switch (myArgs.outputFormat) {
+    case OutputFormat::Cbor:
+        return nlohmann::json::from_cbor(record.begin(), record.end());
+    case OutputFormat::Msgpack:
+        return nlohmann::json::from_msgpack(record.begin(), record.end());
+    default:
+        return nlohmann::json::parse(record.begin(), record.end());
+    }
+}
 
-            if (v->type() != nAttrs)
-                throw TypeError("root is of type '%s', expected a set", showType(*v));
+/* Append the attribute `name' to the attribute path `prefix',
+   quoting it if it contains a dot so that splitAttrPath() gives it
+   back unchanged. */
+static std::string appendAttrPath(const std::string & prefix, const std::string & name)
+{
+    auto quoted = name.find('.') != std::string::npos ? "\"" + name + "\"" : name;
+    return prefix.empty() ? quoted : prefix + "." + quoted;
+}
 
-            if (attrName.empty()) throw Error("empty attribute name");
+/* Messages exchanged between the master and the workers. Each one
+   is framed as its type, the length of its payload and the payload
+   itself, so that large results are read in a few system calls
+   instead of being scanned for newlines. */
+enum class MessageType : uint8_t
+{
+    /* Worker -> master: ready to evaluate a job. */
+    Next,
+    /* Master -> worker: evaluate the jobs in the payload, a JSON
+       list of attribute paths, in order. */
+    Do,
+    /* Master -> worker: there is nothing left to do. */
+    Exit,
+    /* Worker -> master: exiting because of its memory use. Jobs of
+       the current batch it did not start are left to the master. */
+    Restart,
+    /* Worker -> master: about to restart, please start a successor. */
+    Standby,
+    /* Worker -> master: a record describing a derivation or an
+       evaluation error of a job, already serialised in the output
+       format, sent as soon as it is known. A job
+       may have any number of results. */
+    Result,
+    /* Worker -> master: a JSON object listing the attribute paths
+       below a nested attribute set. */
+    Children,
+    /* Worker -> master: the worker failed and cannot continue. */
+    Error,
+    /* Worker -> master: the current job of the batch is finished. The
+       payload is a JSON object with the time in seconds and the memory
+       in KiB it took, the number of results sent for it, the
+       derivations it produced and whether it failed. */
+    JobDone,
+};
 
-            auto a = v->attrs->get(state.symbols.create(attrName));
+struct MessageHeader
+{
+    MessageType type;
+    uint32_t length;
+};
 
-            auto attrVal = state.allocValue();
+static constexpr size_t messageHeaderSize = 1 + sizeof(uint32_t);
 
-            state.autoCallFunction(autoArgs, *a->value, *attrVal);
-            state.forceValue(*attrVal);
+static void writeMessage(int fd, MessageType type, std::string_view payload = {})
+{
+    std::string frame;
+    frame.reserve(messageHeaderSize + payload.size());
+    frame.push_back((char) type);
+    uint32_t length = payload.size();
+    frame.append((const char *) &length, sizeof(length));
+    frame.append(payload);
+    writeFull(fd, frame);
+}
 
-            //  Hacky workaround for nixos systems whose "system" attribute is a drv
-            std::optional<std::string> nixosSystemTuple = {};
+static MessageHeader parseMessageHeader(const char * buf)
+{
+    MessageHeader header;
+    header.type = (MessageType) buf[0];
+    memcpy(&header.length, buf + 1, sizeof(header.length));
+    return header;
+}
 
-            auto systemAttr = attrVal->attrs->find(state.symbols.create("system"));
+static std::pair<MessageType, std::string> readMessage(int fd)
+{
+    char buf[messageHeaderSize];
+    readFull(fd, buf, sizeof(buf));
+    auto header = parseMessageHeader(buf);
+    std::string payload(header.length, 0);
+    readFull(fd, payload.data(), payload.size());
+    return {header.type, std::move(payload)};
+}
 
-            if (auto nixosDrv = getDerivation(state, *systemAttr->value, false)) {
-                nixosSystemTuple = nixosDrv->querySystem();
-            }
+/* Return the current resident set size of this process in KiB. */
+static size_t currentRss()
+{
+#if __linux__
+    auto statm = tokenizeString<std::vector<std::string>>(readFile("/proc/self/statm"));
+    if (statm.size() >= 2)
+        return std::stoull(statm[1]) * (sysconf(_SC_PAGESIZE) / 1024);
+#elif __APPLE__
+    mach_task_basic_info_data_t info;
+    mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+    if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t) &info, &count) == KERN_SUCCESS)
+        return info.resident_size / 1024;
+#endif
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    return r.ru_maxrss;
+}
 
-            DrvInfos drvs;
-            getDerivations(state, *attrVal, "", autoArgs, drvs, false);
+/* Decide whether a worker should exit and be replaced after a job.
+   Above the maximum memory size it always does. Above the soft
+   memory size it only does if the live GC heap is that large too:
+   memory freed by the collector is reused for subsequent jobs even
+   though it is not returned to the operating system. */
+static bool shouldRestart()
+{
+    auto rss = currentRss();
 
-            if (!drvs.empty()) {
-                for (auto drv : drvs) {
-                    std::string system;
+    if (rss > myArgs.maxMemorySize * 1024) return true;
 
-                    if (auto sys = nixosSystemTuple) {
-                        system = *sys;
-                    } else {
-                        system = drv.querySystem();
-                    }
+    if (!myArgs.softMemorySize || rss <= myArgs.softMemorySize * 1024) return false;
 
-                    if (system == "unknown")
-                        throw EvalError("derivation must not have unknown system type");
+#if HAVE_BOEHMGC
+    /* Don't collect after every job once we are over the soft limit,
+       only when enough has been allocated since the last collection
+       for the outcome to possibly differ. */
+    if (myArgs.forceGc && GC_get_bytes_since_gc() > myArgs.softMemorySize * 1024 * 1024 / 16)
+        GC_gcollect();
 
-                    auto drvPath = drv.queryDrvPath();
-                    auto localStore = state.store.dynamic_pointer_cast<LocalFSStore>();
-                    auto storePath = localStore->parseStorePath(drvPath);
-                    auto outputs = drv.queryOutputs(false);
+    return (GC_get_heap_size() - GC_get_free_bytes()) / 1024 > myArgs.softMemorySize * 1024;
+#else
+    return true;
+#endif
+}
 
-                    auto reply = response(attrName);
+/* Whether a worker is within reach of the memory size at which
+   shouldRestart() will tell it to exit. */
+static bool nearRestart()
+{
+    auto limit = myArgs.softMemorySize ? myArgs.softMemorySize : myArgs.maxMemorySize;
+    return currentRss() > limit * 1024 * 4 / 5;
+}
 
-                    reply["name"] = drv.queryName();
-                    reply["system"] = system;
-                    reply["drvPath"] = drvPath;
-                    for (auto out : outputs){
-                        reply["outputs"][out.first] = out.second;
-                    }
+/* Convert the meta value `v' to JSON like printValueAsJSON(), but
+   directly rather than by printing and parsing it again. The rare
+   values that need more than a plain conversion are left to
+   printValueAsJSON(). */
+static nlohmann::json metaValueToJSON(EvalState & state, Value & v)
+{
+    state.forceValue(v);
 
-                    if (myArgs.meta) {
-                        nlohmann::json meta;
-                        for (auto & name : drv.queryMetaNames()) {
-                          PathSet context;
-                          std::stringstream ss;
-
-                          auto metaValue = drv.queryMeta(name);
-                          // Skip non-serialisable types
-                          // TODO: Fix serialisation of derivations to store paths
-                          if (metaValue == 0) {
-                            continue;
-                          }
-
-                          printValueAsJSON(state, true, *metaValue, noPos, ss, context);
-                          nlohmann::json field = nlohmann::json::parse(ss.str());
-                          meta[name] = field;
-                        }
-                        reply["meta"] = meta;
-                    }
+    switch (v.type()) {
 
-                    writeLine(to.get(), reply.dump());
+    case nInt:
+        return v.integer;
 
-                    /* Register the derivation as a GC root.  !!! This
-                       registers roots for jobs that we may have already
-                       done. */
-                    if (gcRootsDir != "") {
-                        Path root = gcRootsDir + "/" + std::string(baseNameOf(drvPath));
-                        if (!pathExists(root))
-                            localStore->addPermRoot(storePath, root);
-                    }
-                }
-            }
+    case nFloat:
+        return v.fpoint;
 
-            else if (attrVal->type() == nNull)
-                ;
+    case nBool:
+        return v.boolean;
 
-            else {
-                throw TypeError("attribute '%s' is of type '%s', which is not supported", attrName, showType(*attrVal));
-            }
+    case nNull:
+        return nullptr;
 
-        } catch (EvalError & e) {
-            auto err = e.info();
+    case nString:
+        return v.string.s;
 
-            std::ostringstream oss;
-            showErrorInfo(oss, err, loggerSettings.showTrace.get());
-            auto msg = oss.str();
+    case nList: {
+        auto list = nlohmann::json::array();
+        for (unsigned int n = 0; n < v.listSize(); ++n)
+            list.push_back(metaValueToJSON(state, *v.listElems()[n]));
+        return list;
+    }
 
-            auto reply = response(attrName);
+    case nAttrs:
+        if (v.attrs->find(state.sToString) != v.attrs->end())
+            break;
 
-            // Transmits the error we got from the previous evaluation
-            // in the JSON output.
-            reply["error"] = filterANSIEscapes(msg, true);
-            // Don't forget to print it into the STDERR log, this is
-            // what's shown in the Hydra UI.
-            printError(e.msg());
+        if (auto i = v.attrs->find(state.sOutPath); i != v.attrs->end())
+            return metaValueToJSON(state, *i->value);
 
-            writeLine(to.get(), reply.dump());
+        {
+            auto attrs = nlohmann::json::object();
+            for (auto & i : *v.attrs)
+                attrs[i.name] = metaValueToJSON(state, *i.value);
+            return attrs;
         }
 
-        /* If our RSS exceeds the maximum, exit. The master will
-           start a new process. */
-        struct rusage r;
-        getrusage(RUSAGE_SELF, &r);
-        if ((size_t) r.ru_maxrss > myArgs.maxMemorySize * 1024) break;
+    default:
+        break;
     }
 
-    writeLine(to.get(), "restart");
+    PathSet context;
+    std::stringstream ss;
+    printValueAsJSON(state, true, v, noPos, ss, context);
+    return nlohmann::json::parse(ss.str());
 }
 
-int main(int argc, char * * argv)
+static nlohmann::json queryMeta(EvalState & state, DrvInfo & drv)
 {
-    /* Prevent undeclared dependencies in the evaluation via
-       $NIX_PATH. */
-    unsetenv("NIX_PATH");
+    nlohmann::json meta;
+    /* With --meta-keys, the other meta attributes are not even
+       forced. */
+    for (auto & name : myArgs.metaKeys ? *myArgs.metaKeys : drv.queryMetaNames()) {
+      auto metaValue = drv.queryMeta(name);
+      // Skip missing and non-serialisable types
+      // TODO: Fix serialisation of derivations to store paths
+      if (metaValue == 0) {
+        continue;
+      }
+
+      meta[name] = metaValueToJSON(state, *metaValue);
+    }
+    return meta;
+}
 
-    return handleExceptions(argv[0], [&]() {
-        initNix();
-        initGC();
+static void addGcRoot(ref<Store> store, const Path & gcRootsDir, const std::string & drvPath)
+{
+    if (gcRootsDir == "") return;
 
-        myArgs.parseCmdline(argvToStrings(argc, argv));
+    Path root = gcRootsDir + "/" + std::string(baseNameOf(drvPath));
+    if (!pathExists(root)) {
+        auto localStore = store.dynamic_pointer_cast<LocalFSStore>();
+        auto storePath = localStore->parseStorePath(drvPath);
+        localStore->addPermRoot(storePath, root);
+    }
+}
 
-        /* FIXME: The build hook in conjunction with import-from-derivation is causing "unexpected EOF" during eval */
-        settings.builders = "";
+/* Whether the job `attrPath' belongs to our shard. The attribute
+   path is hashed, so that all machines evaluating a shard each agree
+   on the partition without talking to each other. */
+static bool inShard(const std::string & attrPath)
+{
+    if (myArgs.shardCount == 1) return true;
 
-        /* Prevent access to paths outside of the Nix search path and
-           to the environment. */
-        evalSettings.restrictEval = false;
+    auto hash = hashString(htSHA256, attrPath);
+    uint64_t n = 0;
+    for (size_t i = 0; i < sizeof(n); i++)
+        n = n << 8 | hash.hash[i];
 
-        /* When building a flake, use pure evaluation (no access to
-           'getEnv', 'currentSystem' etc. */
-        evalSettings.pureEval = myArgs.evalMode == evalAuto ? myArgs.flake : myArgs.evalMode == evalPure;
+    return n % myArgs.shardCount == myArgs.shardIndex;
+}
 
-        if (myArgs.releaseExpr == "") throw UsageError("no expression specified");
+/* Whether the first components of the attribute path `names' match
+   those of the glob `pattern', as far as both go. */
+static bool matchAttrPath(
+    const std::vector<std::string> & pattern,
+    const std::vector<std::string> & names)
+{
+    for (size_t i = 0; i < std::min(pattern.size(), names.size()); i++)
+        if (fnmatch(pattern[i].c_str(), names[i].c_str(), 0) != 0)
+            return false;
+    return true;
+}
 
-        if (myArgs.gcRootsDir == "") printMsg(lvlError, "warning: `--gc-roots-dir' not specified");
+/* How the job `attrPath' fares with --include-attr and
+   --exclude-attr. A glob selects the jobs it matches along with
+   everything below them. */
+enum class Selection
+{
+    /* Neither the job nor anything below it is selected. */
+    None,
+    /* Only jobs below it may be selected, so the job itself is only
+       evaluated to find them. */
+    Below,
+    /* The job is selected. */
+    Selected,
+};
 
-        if (myArgs.showTrace) {
-            loggerSettings.showTrace.assign(true);
-        }
+static Selection selection(const std::string & attrPath)
+{
+    auto names = splitAttrPath(attrPath);
 
-        struct State
-        {
-            std::set<std::string> todo{};
-            std::set<std::string> active;
-            std::exception_ptr exc;
-        };
+    for (auto & pattern : myArgs.excludeAttrs)
+        if (pattern.size() <= names.size() && matchAttrPath(pattern, names))
+            return Selection::None;
 
-        std::condition_variable wakeup;
+    if (myArgs.includeAttrs.empty()) return Selection::Selected;
 
-        Sync<State> state_;
+    auto result = Selection::None;
 
-        /* Start a handler thread per worker process. */
-        auto handler = [&]()
-        {
-            try {
-                std::optional<Pid> pid;
-                AutoCloseFD from, to;
-
-                while (true) {
-
-                    /* Start a new worker process if necessary. */
-                    if (!pid.has_value()) {
-                        Pipe toPipe, fromPipe;
-                        toPipe.create();
-                        fromPipe.create();
-                        pid = startProcess(
-                            [&,
-                             to{std::make_shared<AutoCloseFD>(std::move(fromPipe.writeSide))},
-                             from{std::make_shared<AutoCloseFD>(std::move(toPipe.readSide))}
-                            ]()
-                            {
-                                debug("created worker process %d", getpid());
-                                try {
-                                    EvalState state(myArgs.searchPath, openStore());
-                                    Bindings & autoArgs = *myArgs.getAutoArgs(state);
-                                    worker(state, autoArgs, *to, *from, myArgs.gcRootsDir);
-                                } catch (Error & e) {
-                                    nlohmann::json err;
-                                    auto msg = e.msg();
-                                    err["error"] = filterANSIEscapes(msg, true);
-                                    printError(msg);
-                                    writeLine(to->get(), err.dump());
-                                    // Don't forget to print it into the STDERR log, this is
-                                    // what's shown in the Hydra UI.
-                                    writeLine(to->get(), "restart");
-                                }
-                            },
-                            ProcessOptions { .allowVfork = false });
-                        from = std::move(fromPipe.readSide);
-                        to = std::move(toPipe.writeSide);
-                    }
+    for (auto & pattern : myArgs.includeAttrs)
+        if (matchAttrPath(pattern, names)) {
+            if (pattern.size() <= names.size()) return Selection::Selected;
+            result = Selection::Below;
+        }
 
-                    /* Check whether the existing worker process is still there. */
-                    auto s = readLine(from.get());
-                    if (s == "restart") {
-                        pid = std::nullopt;
-                        continue;
-                    } else if (s != "next") {
-                        auto json = nlohmann::json::parse(s);
+    return result;
+}
 
-                        if (json.find("error") != json.end())
-                            throw Error("worker error: %s", (std::string) json["error"]);
-                    }
+/* Whether an --include-attr glob names `attrPath' itself or jobs
+   below it, in which case we look into it even if it does not have
+   `recurseForDerivations = true'. */
+static bool namedByInclude(const std::string & attrPath)
+{
+    auto names = splitAttrPath(attrPath);
 
-                    /* Wait for a job name to become available. */
-                    std::string attrPath;
-
-                    while (true) {
-                        checkInterrupt();
-                        auto state(state_.lock());
-                        if ((state->todo.empty() && state->active.empty()) || state->exc) {
-                            writeLine(to.get(), "exit");
-                            return;
-                        }
-                        if (!state->todo.empty()) {
-                            attrPath = *state->todo.begin();
-                            state->todo.erase(state->todo.begin());
-                            state->active.insert(attrPath);
-                            break;
-                        } else
-                            state.wait(wakeup);
-                    }
+    for (auto & pattern : myArgs.includeAttrs)
+        if (pattern.size() >= names.size() && matchAttrPath(pattern, names))
+            return true;
 
-                    /* Tell the worker to evaluate it. */
-                    writeLine(to.get(), "do " + attrPath);
+    return false;
+}
 
-                    /* Handle the response. */
-                    auto respString = readLine(from.get());
-                    auto response = nlohmann::json::parse(respString);
-                    auto state(state_.lock());
-                    std::cout << response << "\n" << std::flush;
+/* Looks up the attribute paths of jobs in the root. The attribute
+   sets along the way are auto-called and forced only once per worker
+   and kept for the following jobs, so that the siblings of a job do
+   not redo that for their parents. */
+struct AttrPathResolver
+{
+    EvalState & state;
+    Bindings & autoArgs;
+
+    /* The attribute sets by attribute path, with the root at "".
+       Unlike a plain map, this one is scanned by the garbage
+       collector. */
+    std::map<std::string, Value *, std::less<std::string>,
+        traceable_allocator<std::pair<const std::string, Value *>>> sets;
+
+    /* Attribute path components looked up since the last reset, and
+       how many of them were parents we already had. */
+    uint64_t evaluated = 0;
+    uint64_t memoised = 0;
+
+    AttrPathResolver(EvalState & state, Bindings & autoArgs, Value * vRoot)
+        : state(state), autoArgs(autoArgs)
+    {
+        sets.emplace("", forceSet(*vRoot, "", true));
+    }
 
-                    state->active.erase(attrPath);
-                    wakeup.notify_all();
-                }
-            } catch (...) {
-                auto state(state_.lock());
-                state->exc = std::current_exception();
-                wakeup.notify_all();
-            }
-        };
+    /* Like getDerivations(), only auto-call the root and the
+       top-level attributes, and merely force the sets below them. */
+    Value * forceSet(Value & v, const std::string & attrPath, bool autoCall)
+    {
+        auto vSet = &v;
+        if (autoCall) {
+            vSet = state.allocValue();
+            state.autoCallFunction(autoArgs, v, *vSet);
+        }
+        state.forceValue(*vSet);
+        if (vSet->type() != nAttrs)
+            throw TypeError("the expression selected by the selection path '%s' should be a set but is %s",
+                attrPath, showType(*vSet));
+        return vSet;
+    }
 
-        /* Collect initial attributes to evaluate. This must be done
-           in a separate fork to avoid spawning a download in the
-           parent process. If that happens, worker processes will try
-           to enqueue downloads on their own download threads (which
-           will not exist). */
-        {
-            AutoCloseFD from, to;
-            Pipe toPipe, fromPipe;
-            toPipe.create();
-            fromPipe.create();
-            Pid p = startProcess(
-                [&,
-                 to{std::make_shared<AutoCloseFD>(std::move(fromPipe.writeSide))},
-                 from{std::make_shared<AutoCloseFD>(std::move(toPipe.readSide))}
-                ]()
-                {
-                    debug("created initial attribute collection process %d", getpid());
+    /* Return the value of `attrPath', without auto-calling it. */
+    Value * resolve(const std::string & attrPath)
+    {
+        auto names = splitAttrPath(attrPath);
+        if (names.empty()) throw Error("empty attribute name");
+
+        Value * vSet = sets.at("");
+        std::string prefix;
+        size_t n = 0;
+
+        for (; n + 1 < names.size(); n++) {
+            auto i = sets.find(appendAttrPath(prefix, names[n]));
+            if (i == sets.end()) break;
+            vSet = i->second;
+            prefix = i->first;
+            memoised++;
+        }
 
-                    nlohmann::json reply;
+        while (true) {
+            auto a = vSet->attrs->find(state.symbols.create(names[n]));
+            if (a == vSet->attrs->end())
+                throw AttrPathNotFound("attribute '%s' in selection path '%s' not found", names[n], attrPath);
+            evaluated++;
 
-                    try {
-                        EvalState state(myArgs.searchPath, openStore());
-                        Bindings & autoArgs = *myArgs.getAutoArgs(state);
+            if (++n == names.size()) return a->value;
 
-                        auto vRoot = releaseExprTopLevelValue(state, autoArgs);
+            prefix = appendAttrPath(prefix, names[n - 1]);
+            vSet = forceSet(*a->value, prefix, n == 1);
+            sets.emplace(prefix, vSet);
+        }
+    }
+};
 
-                        if (vRoot->type() != nAttrs) {
-                            std::stringstream ss;
-                            ss << "top level value is '" << showType(*vRoot) << "', expected an attribute set";
+/* Whether to output the derivation field `field'. Without --fields,
+   that is all fields except for the meta attributes, which --meta
+   asks for. */
+static bool wantField(const std::string & field)
+{
+    return myArgs.fields
+        ? myArgs.fields->count(field)
+        : field != "meta" || myArgs.meta;
+}
 
-                            reply["error"] = ss.str();
-                        } else {
-                            std::vector<std::string> attrs;
-                            for (auto & a : vRoot->attrs->lexicographicOrder())
-                                attrs.push_back(a->name);
+/* Send a result of the current job to the master right away. The
+   master checks their number in `done' against the results it got,
+   to tell complete jobs from truncated ones. */
+static void sendResult(AutoCloseFD & to, const nlohmann::json & reply, nlohmann::json & done)
+{
+    writeMessage(to.get(), MessageType::Result, encodeRecord(reply));
+    done["results"] = done["results"].get<uint64_t>() + 1;
+}
 
-                            reply["attrs"] = attrs;
-                        }
-                    } catch (Error & e) {
-                        auto msg = e.msg();
-                        reply["error"] = filterANSIEscapes(msg, true);
-                        printError(msg);
-                    }
+/* Evaluate the job `attrPath' and send the results back to the
+   master. What the master needs to know about the job besides the
+   results goes into `done'. */
+static void evaluateJob(
+    EvalState & state,
+    Bindings & autoArgs,
+    AttrPathResolver & resolver,
+    AutoCloseFD & to,
+    const std::string & attrPath,
+    const Path & gcRootsDir,
+    nlohmann::json & done)
+{
+    try {
+        bool topLevel = splitAttrPath(attrPath).size() == 1;
+
+        /* Like getDerivations(), only auto-call the top-level jobs.
+           The values below them are merely forced, so that functions
+           there are ignored rather than called. */
+        auto attrVal = resolver.resolve(attrPath);
+
+        if (topLevel) {
+            auto vCalled = state.allocValue();
+            state.autoCallFunction(autoArgs, *attrVal, *vCalled);
+            attrVal = vCalled;
+        }
 
-                    writeLine(to->get(), reply.dump());
-                },
-                ProcessOptions { .allowVfork = false });
-            from = std::move(fromPipe.readSide);
-            to = std::move(toPipe.writeSide);
+        state.forceValue(*attrVal);
 
-            auto s = readLine(from.get());
-            auto json = nlohmann::json::parse(s);
+        /* Rather than recursing into nested attribute sets
+           ourselves, hand their children back to the master so
+           that they are evaluated in parallel. Like
+           getDerivations(), we always descend into the top-level
+           jobs but only into deeper sets that have
+           `recurseForDerivations = true', skip the attributes whose
+           names it skips, and ignore deeper values that are neither
+           sets nor derivations. */
 
-            if (json.find("error") != json.end()) {
-                throw Error("getting initial attributes: %s", (std::string) json["error"]);
+        if (!state.isDerivation(*attrVal)
+            && (attrVal->type() == nAttrs || attrVal->type() == nNull || !topLevel))
+        {
+            std::vector<std::string> children;
 
-            } else if (json.find("attrs") != json.end()) {
-                auto state(state_.lock());
-                for (std::string a : json["attrs"])
-                    state->todo.insert(a);
+            if (attrVal->type() == nAttrs) {
+                bool recurse = topLevel || namedByInclude(attrPath);
 
-            } else {
-                throw Error("expected object with \"error\" or \"attrs\", got: %s", s);
+                if (!recurse) {
+                    auto i = attrVal->attrs->find(state.sRecurseForDerivations);
+                    recurse = i != attrVal->attrs->end() && state.forceBool(*i->value, *i->pos);
+                }
+
+                static const std::regex attrRegex("[A-Za-z_][A-Za-z0-9-_+]*");
 
+                if (recurse)
+                    for (auto & i : attrVal->attrs->lexicographicOrder())
+                        if (std::regex_match(std::string(i->name), attrRegex))
+                            children.push_back(appendAttrPath(attrPath, i->name));
             }
+
+            auto reply = response(attrPath);
+            reply["children"] = children;
+            writeMessage(to.get(), MessageType::Children, reply.dump());
+            return;
         }
 
-        std::vector<std::thread> threads;
-        for (size_t i = 0; i < myArgs.nrWorkers; i++)
-            threads.emplace_back(std::thread(handler));
+        /* The jobs of other shards and the ones only leading to
+           selected jobs still have to be evaluated as far as needed
+           to find the jobs below them, but no further. */
+        if (!inShard(attrPath) || selection(attrPath) != Selection::Selected) return;
 
-        for (auto & thread : threads)
-            thread.join();
+        //  Hacky workaround for nixos systems whose "system" attribute is a drv
+        std::optional<std::string> nixosSystemTuple = {};
 
-        auto state(state_.lock());
+        if (attrVal->type() == nAttrs && wantField("system")) {
+            auto systemAttr = attrVal->attrs->find(state.sSystem);
 
-        if (state->exc)
-            std::rethrow_exception(state->exc);
+            if (systemAttr != attrVal->attrs->end())
+                if (auto nixosDrv = getDerivation(state, *systemAttr->value, false))
+                    nixosSystemTuple = nixosDrv->querySystem();
+        }
+
+        DrvInfos drvs;
+        getDerivations(state, *attrVal, "", autoArgs, drvs, false);
+
+        if (!drvs.empty()) {
+            for (auto drv : drvs) {
+                auto reply = response(attrPath);
+
+                /* Only force what we output, since some fields can be
+                   expensive to compute. */
+                if (wantField("system")) {
+                    std::string system;
+
+                    if (auto sys = nixosSystemTuple) {
+                        system = *sys;
+                    } else {
+                        system = drv.querySystem();
+                    }
+
+                    if (system == "unknown")
+                        throw EvalError("derivation must not have unknown system type");
+
+                    reply["system"] = system;
+                }
+
+                if (wantField("name"))
+                    reply["name"] = drv.queryName();
+
+                /* The GC roots need the derivation either way. */
+                std::optional<std::string> drvPath;
+                if (wantField("drvPath") || gcRootsDir != "") {
+                    drvPath = drv.queryDrvPath();
+                    if (wantField("drvPath"))
+                        reply["drvPath"] = *drvPath;
+                }
+
+                if (wantField("outputs")) {
+                    auto outputs = drv.queryOutputs(false);
+                    for (auto out : outputs){
+                        reply["outputs"][out.first] = out.second;
+                    }
+                }
+
+                if (wantField("meta"))
+                    reply["meta"] = queryMeta(state, drv);
+
+                sendResult(to, reply, done);
+
+                if (drvPath) {
+                    /* Register the derivation as a GC root.  !!! This
+                       registers roots for jobs that we may have already
+                       done. */
+                    addGcRoot(state.store, gcRootsDir, *drvPath);
+
+                    done["drvPaths"].push_back(*drvPath);
+                }
+            }
+        }
+
+        else {
+            throw TypeError("attribute '%s' is of type '%s', which is not supported", attrPath, showType(*attrVal));
+        }
+
+    } catch (EvalError & e) {
+        auto err = e.info();
+
+        std::ostringstream oss;
+        showErrorInfo(oss, err, loggerSettings.showTrace.get());
+        auto msg = oss.str();
+
+        auto reply = response(attrPath);
+
+        // Transmits the error we got from the previous evaluation
+        // in the JSON output.
+        reply["error"] = filterANSIEscapes(msg, true);
+        // Don't forget to print it into the STDERR log, this is
+        // what's shown in the Hydra UI.
+        printError(e.msg());
+
+        sendResult(to, reply, done);
+
+        done["failed"] = true;
+    }
+}
+
+/* The evaluation cache of the flake as used by a worker. A cache
+   keeps a transaction open until it is destroyed, and once it has
+   written something, the other workers wait for it. So one cache
+   serves the jobs of a worker as long as they are found in it, which
+   only reads from it, and is dropped after a job that was not, to
+   commit what that job recorded. It is also dropped while the worker
+   waits for jobs. */
+struct WorkerEvalCache
+{
+    std::shared_ptr<eval_cache::EvalCache> cache;
+
+    /* Whether the last job was found in the cache. */
+    bool warm = false;
+};
+
+/* Like evaluateJob(), but take the derivation of the job from the
+   evaluation cache of the flake if possible. Anything other than a
+   derivation is cheap to evaluate and handled by evaluateJob(). */
+static void evaluateJobCached(
+    EvalState & state,
+    Bindings & autoArgs,
+    AttrPathResolver & resolver,
+    const FlakeInfo & flakeInfo,
+    WorkerEvalCache & evalCache,
+    AutoCloseFD & to,
+    const std::string & attrPath,
+    const Path & gcRootsDir,
+    nlohmann::json & done)
+{
+    try {
+        /* Find the job with the evaluator first. That is cheap, since
+           the sets along the way are memoised, and it leaves less to
+           evaluate to the evaluation cache below. Everything that is
+           not a derivation is handled by evaluateJob() anyway. */
+        auto attrVal = resolver.resolve(attrPath);
+        state.forceValue(*attrVal);
+
+        if (state.isDerivation(*attrVal)) {
+            std::vector<Symbol> path;
+            if (!flakeInfo.fragment.empty())
+                for (auto & name : splitAttrPath(flakeInfo.fragment))
+                    path.push_back(state.symbols.create(name));
+            for (auto & name : splitAttrPath(attrPath))
+                path.push_back(state.symbols.create(name));
+
+            auto openCache = [&]()
+            {
+                return std::make_shared<eval_cache::EvalCache>(
+                    std::optional { std::cref(*flakeInfo.fingerprint) }, state,
+                    [&]() { return flakeInfo.outputs; });
+            };
+
+            auto lookup = [&](eval_cache::EvalCache & cache)
+            {
+                auto cursor = cache.getRoot()->findAlongAttrPath(path, true);
+                return cursor && cursor->isDerivation() ? cursor : nullptr;
+            };
+
+            /* The cache evaluates what it does not have from the same
+               values as the evaluator, so the derivation path is left
+               unevaluated if and only if the cache has it. */
+            auto drvPathAttr = attrVal->attrs->find(state.sDrvPath);
+            auto unevaluated = [&]()
+            {
+                return drvPathAttr != attrVal->attrs->end() && drvPathAttr->value->type() == nThunk;
+            };
+            bool found = unevaluated();
+
+            /* After a job that was not in the cache, the next one
+               probably is not either. Record the attribute sets
+               leading to it in a cache of its own, so that we do not
+               hold on to the writes while evaluating the derivation
+               path below. */
+            if (!evalCache.warm) {
+                evalCache.cache.reset();
+                if (!lookup(*openCache())) {
+                    evaluateJob(state, autoArgs, resolver, to, attrPath, gcRootsDir, done);
+                    return;
+                }
+            }
+
+            if (!evalCache.cache)
+                evalCache.cache = openCache();
+
+            auto reply = response(attrPath);
+            std::string drvPath;
+
+            {
+                auto cursor = lookup(*evalCache.cache);
+                if (!cursor) {
+                    evaluateJob(state, autoArgs, resolver, to, attrPath, gcRootsDir, done);
+                    return;
+                }
+
+                drvPath = state.store->printStorePath(cursor->forceDerivation());
+
+                if (wantField("system")) {
+                    auto system = cursor->getAttr(state.sSystem)->getString();
+                    if (system == "unknown")
+                        throw EvalError("derivation must not have unknown system type");
+                    reply["system"] = system;
+                }
+
+                if (wantField("name"))
+                    reply["name"] = cursor->getAttr(state.sName)->getString();
+            }
+
+            evalCache.warm = found && unevaluated();
+            if (!evalCache.warm)
+                evalCache.cache.reset();
+
+            if (wantField("drvPath"))
+                reply["drvPath"] = drvPath;
+
+            /* The output paths are not in the evaluation cache, but
+               the derivation is in the store anyway. */
+            if (wantField("outputs")) {
+                auto drv = state.store->readDerivation(state.store->parseStorePath(drvPath));
+                for (auto & [outputName, output] : drv.outputsAndOptPaths(*state.store))
+                    if (output.second)
+                        reply["outputs"][outputName] = state.store->printStorePath(*output.second);
+            }
+
+            if (wantField("meta"))
+                if (auto drvInfo = getDerivation(state, *attrVal, false))
+                    reply["meta"] = queryMeta(state, *drvInfo);
+
+            sendResult(to, reply, done);
+
+            addGcRoot(state.store, gcRootsDir, drvPath);
+
+            done["drvPaths"].push_back(drvPath);
+            return;
+        }
+
+    } catch (EvalError & e) {
+        /* Let evaluateJob() report the error. */
+        debug("evaluation cache lookup of '%s' failed: %s", attrPath, e.msg());
+        evalCache.cache.reset();
+        evalCache.warm = false;
+    }
+
+    evaluateJob(state, autoArgs, resolver, to, attrPath, gcRootsDir, done);
+}
+
+static void worker(
+    EvalState & state,
+    Bindings & autoArgs,
+    Value * vRoot,
+    const FlakeInfo & flakeInfo,
+    AutoCloseFD & to,
+    AutoCloseFD & from,
+    const Path &gcRootsDir)
+{
+    bool standbyRequested = false;
+
+    /* A new worker starts out with the memory of the zygote, root and
+       all, so it only checks its memory after doing a job. Otherwise
+       a root above the memory limit would have the master fork
+       workers that exit right away forever. */
+    bool didJob = false;
+
+    /* The evaluation cache is only valid for pure evaluations, and
+       does not know about auto-called functions, so it can only be
+       used without arguments. */
+    bool useEvalCache = myArgs.evalCacheLookup && evalSettings.useEvalCache
+        && evalSettings.pureEval && flakeInfo.fingerprint && autoArgs.empty();
+
+    if (myArgs.evalCacheLookup && !useEvalCache)
+        debug("not using the evaluation cache");
+
+    AttrPathResolver resolver(state, autoArgs, vRoot);
+
+    WorkerEvalCache evalCache;
+
+    while (true) {
+        /* If we use too much memory, exit. The master will start a
+           new process. */
+        if (didJob && shouldRestart()) break;
+
+        evalCache.cache.reset();
+
+        /* Wait for the master to send us a batch of jobs. */
+        writeMessage(to.get(), MessageType::Next);
+
+        auto [type, payload] = readMessage(from.get());
+        if (type == MessageType::Exit) break;
+        if (type != MessageType::Do) abort();
+
+        auto batch = nlohmann::json::parse(payload).get<std::vector<std::string>>();
+
+        size_t n = 0;
+        for (; n < batch.size(); n++) {
+            auto & attrPath = batch[n];
+
+            /* Check our memory between the jobs of a batch, too. */
+            if (n > 0 && shouldRestart()) break;
+
+            /* Once we get close to the limit, ask the master to start
+               our successor so that it is ready when we exit. */
+            if (!standbyRequested && nearRestart()) {
+                writeMessage(to.get(), MessageType::Standby);
+                standbyRequested = true;
+            }
+
+            debug("worker process %d at '%s'", getpid(), attrPath);
+
+            /* Evaluate it and send info back to the master, followed
+               by what it cost us. */
+            auto before = std::chrono::steady_clock::now();
+            auto rssBefore = currentRss();
+
+            nlohmann::json done;
+            done["drvPaths"] = nlohmann::json::array();
+            done["results"] = 0;
+            done["failed"] = false;
+
+            resolver.evaluated = resolver.memoised = 0;
+
+            /* Only the jobs evaluateJob() would output can be taken
+               from the evaluation cache. */
+            if (useEvalCache && inShard(attrPath) && selection(attrPath) == Selection::Selected)
+                evaluateJobCached(state, autoArgs, resolver, flakeInfo, evalCache, to, attrPath, gcRootsDir, done);
+            else
+                evaluateJob(state, autoArgs, resolver, to, attrPath, gcRootsDir, done);
+
+            done["attrsEvaluated"] = resolver.evaluated;
+            done["attrsMemoised"] = resolver.memoised;
+
+            done["time"] = std::chrono::duration<double>(std::chrono::steady_clock::now() - before).count();
+            done["memory"] = std::max(currentRss(), rssBefore) - rssBefore;
+            writeMessage(to.get(), MessageType::JobDone, done.dump());
+            didJob = true;
+        }
+
+        /* If we stopped in the middle of the batch, the master hands
+           the rest of it to our successor. */
+        if (n < batch.size()) break;
+    }
+
+    writeMessage(to.get(), MessageType::Restart);
+}
+
+/* Send a one-byte message carrying the file descriptors `fds' over
+   the unix domain socket `sock'. */
+static void sendFds(int sock, const std::vector<int> & fds)
+{
+    char tag = 'f';
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    while (sendmsg(sock, &msg, 0) == -1)
+        if (errno != EINTR)
+            throw SysError("sending file descriptors");
+}
+
+/* Receive a message sent by sendFds(). Returns an empty vector if
+   the other side closed the socket. */
+static std::vector<AutoCloseFD> receiveFds(int sock)
+{
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+
+    /* We never pass more than a handful of descriptors at once. */
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * 8));
+
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, 0)) == -1)
+        if (errno != EINTR)
+            throw SysError("receiving file descriptors");
+
+    std::vector<AutoCloseFD> fds;
+    if (n == 0) return fds;
+
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        auto count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            closeOnExec(fd);
+            fds.emplace_back(fd);
+        }
+    }
+
+    return fds;
+}
+
+/* Daemon connections are inherited from the zygote and must not be
+   shared between workers, so make every worker drop them and open
+   its own ones on demand. */
+static void resetStoreConnections(ref<Store> store)
+{
+    auto remoteStore = store.dynamic_pointer_cast<RemoteStore>();
+    if (!remoteStore) return;
+
+    auto maxConnectionAge = remoteStore->maxConnectionAge.to_string();
+    remoteStore->set("max-connection-age", "0");
+    remoteStore->flushBadConnections();
+    remoteStore->set("max-connection-age", maxConnectionAge);
+}
+
+/* The number of threads of this process, if we can tell. */
+static std::optional<size_t> threadCount()
+{
+#if __linux__
+    try {
+        return readDirectory("/proc/self/task").size();
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+#elif __APPLE__
+    thread_act_array_t threads;
+    mach_msg_type_number_t count;
+    if (task_threads(mach_task_self(), &threads, &count) != KERN_SUCCESS)
+        return std::nullopt;
+    for (mach_msg_type_number_t i = 0; i < count; i++)
+        mach_port_deallocate(mach_task_self(), threads[i]);
+    vm_deallocate(mach_task_self(), (vm_address_t) threads, count * sizeof(thread_act_t));
+    return count;
+#else
+    return std::nullopt;
+#endif
+}
+
+/* The SQLite databases this process has open, if we can tell. Nix
+   opens its databases (the local store, the fetcher cache, the
+   binary cache cache) when it first needs them and keeps them open
+   until it exits. */
+static std::optional<std::set<Path>> openDatabases()
+{
+    std::set<Path> res;
+
+    auto add = [&](const Path & path)
+    {
+        if (hasSuffix(path, ".sqlite")) res.insert(path);
+    };
+
+#if __linux__
+    try {
+        for (auto & entry : readDirectory("/proc/self/fd")) {
+            try {
+                add(readLink("/proc/self/fd/" + entry.name));
+            } catch (SysError &) {
+                /* The descriptor of the directory listing itself. */
+            }
+        }
+    } catch (SysError &) {
+        return std::nullopt;
+    }
+#elif __APPLE__
+    char path[MAXPATHLEN];
+    for (int fd = 0; fd < getdtablesize(); fd++)
+        if (fcntl(fd, F_GETPATH, path) != -1) add(path);
+#else
+    return std::nullopt;
+#endif
+
+    return res;
+}
+
+/* Whether the workers can be forked from the zygote after it has
+   evaluated the root. Only the calling thread survives fork(), so
+   if the evaluation started a thread, most likely Nix's download
+   thread, the workers would wait for it forever. A SQLite
+   connection must not be used on both sides of fork() either, and
+   the workers would keep using any database the zygote opened, such
+   as the fetcher cache when locking or fetching a flake, or a local
+   store. Only the connections to the daemon are reset in every
+   worker. The databases the zygote inherited from the master are
+   never used by it or the workers. */
+static bool canShareRoot(
+    EvalState & state,
+    std::optional<size_t> threadsBefore,
+    const std::optional<std::set<Path>> & databasesBefore)
+{
+    auto threadsAfter = threadCount();
+
+    if (!threadsBefore || !threadsAfter || *threadsAfter > *threadsBefore) {
+        debug("not sharing the evaluated root with the workers, since its evaluation started threads");
+        return false;
+    }
+
+    auto databasesAfter = openDatabases();
+
+    if (!databasesBefore || !databasesAfter
+        || !std::includes(databasesBefore->begin(), databasesBefore->end(),
+            databasesAfter->begin(), databasesAfter->end()))
+    {
+        debug("not sharing the evaluated root with the workers, since its evaluation opened a database");
+        return false;
+    }
+
+    if (!state.store.dynamic_pointer_cast<RemoteStore>()) {
+        debug("not sharing the evaluated root with the workers, since the store is not accessed through the daemon");
+        return false;
+    }
+
+    return true;
+}
+
+/* Serve the requests of the master for new workers: fork a worker
+   process running `run' for every pair of pipe ends the master sends
+   over `sock', and reply with its pid. */
+static void forkWorkers(
+    AutoCloseFD & sock,
+    std::function<void(AutoCloseFD & to, AutoCloseFD & from)> run)
+{
+    while (true) {
+        /* Reap the workers that exited in the meantime. */
+        while (waitpid(-1, nullptr, WNOHANG) > 0) ;
+
+        auto fds = receiveFds(sock.get());
+        if (fds.empty()) break;
+        if (fds.size() != 2)
+            throw Error("zygote expected 2 file descriptors, got %d", fds.size());
+
+        pid_t pid = startProcess(
+            [&]()
+            {
+                debug("created worker process %d", getpid());
+                sock.close();
+                auto & to = fds[0];
+                auto & from = fds[1];
+                try {
+                    run(to, from);
+                } catch (Error & e) {
+                    auto msg = e.msg();
+                    // Don't forget to print it into the STDERR log, this is
+                    // what's shown in the Hydra UI.
+                    printError(msg);
+                    writeMessage(to.get(), MessageType::Error, filterANSIEscapes(msg, true));
+                }
+            },
+            ProcessOptions { .allowVfork = false });
+
+        writeLine(sock.get(), std::to_string(pid));
+    }
+}
+
+/* The zygote evaluates the release expression once and then forks a
+   worker process for every pair of pipe ends the master sends it.
+   The workers (including the ones replacing workers that exceeded
+   their memory limit) thus start out with the root already
+   evaluated in their copy-on-write heap. If canShareRoot() says
+   that forking after the evaluation is unsafe, it leaves the
+   workers to plainZygote() instead. */
+static void zygote(AutoCloseFD & sock)
+{
+    auto threadsBefore = threadCount();
+    auto databasesBefore = openDatabases();
+
+    EvalState state(myArgs.searchPath, openStore());
+    Bindings & autoArgs = *myArgs.getAutoArgs(state);
+
+    /* Lock the flake and tell the master about the lock right away,
+       so that it can replay cached results while we evaluate the
+       root. */
+    std::optional<flake::LockedFlake> lockedFlake;
+    nlohmann::json locked = nlohmann::json::object();
+
+    try {
+        if (myArgs.flake) {
+            lockedFlake.emplace(lockJobsFlake(state));
+            locked["fingerprint"] = lockedFlake->getFingerprint().to_string(Base16, false);
+            locked["lock"] = lockedFlakeToJSON(*lockedFlake);
+        }
+    } catch (Error & e) {
+        auto msg = e.msg();
+        locked["error"] = filterANSIEscapes(msg, true);
+        printError(msg);
+    }
+
+    writeLine(sock.get(), locked.dump());
+
+    if (locked.find("error") != locked.end()) return;
+
+    /* Report the top-level attributes to the master. This doubles
+       as the initial attribute collection, so the root evaluated for
+       it is the one every worker starts from. */
+    Value * vRoot = nullptr;
+    FlakeInfo flakeInfo;
+    nlohmann::json reply;
+
+    try {
+        vRoot = topLevelValue(state, autoArgs, lockedFlake, flakeInfo);
+        state.forceValue(*vRoot);
+
+        if (vRoot->type() != nAttrs) {
+            std::stringstream ss;
+            ss << "top level value is '" << showType(*vRoot) << "', expected an attribute set";
+
+            reply["error"] = ss.str();
+        } else {
+            std::vector<std::string> attrs;
+            for (auto & a : vRoot->attrs->lexicographicOrder())
+                attrs.push_back(appendAttrPath("", a->name));
+
+            reply["attrs"] = attrs;
+        }
+    } catch (Error & e) {
+        auto msg = e.msg();
+        reply["error"] = filterANSIEscapes(msg, true);
+        printError(msg);
+    }
+
+    /* If forking from here is not safe, the master starts a zygote
+       whose workers evaluate the root themselves instead. */
+    bool shareRoot = reply.find("error") == reply.end() && canShareRoot(state, threadsBefore, databasesBefore);
+    reply["shareRoot"] = shareRoot;
+
+    writeLine(sock.get(), reply.dump());
+
+    if (!shareRoot) return;
+
+    forkWorkers(sock, [&](AutoCloseFD & to, AutoCloseFD & from)
+    {
+        resetStoreConnections(state.store);
+        worker(state, autoArgs, vRoot, flakeInfo, to, from, myArgs.gcRootsDir);
+    });
+}
+
+/* The zygote used when the workers cannot share the root evaluated by
+   zygote(). It forks the workers before evaluating anything, and
+   every worker evaluates the root for itself, calling the flake with
+   the lock `lock' that zygote() reported rather than locking it
+   again. */
+static void plainZygote(AutoCloseFD & sock, const nlohmann::json & lock)
+{
+    forkWorkers(sock, [&](AutoCloseFD & to, AutoCloseFD & from)
+    {
+        EvalState state(myArgs.searchPath, openStore());
+        Bindings & autoArgs = *myArgs.getAutoArgs(state);
+
+        std::optional<flake::LockedFlake> lockedFlake;
+        if (myArgs.flake)
+            lockedFlake.emplace(lockedFlakeFromJSON(lock));
+
+        FlakeInfo flakeInfo;
+        auto vRoot = topLevelValue(state, autoArgs, lockedFlake, flakeInfo);
+        state.forceValue(*vRoot);
+
+        worker(state, autoArgs, vRoot, flakeInfo, to, from, myArgs.gcRootsDir);
+    });
+}
+
+/* Writes the results to stdout from a thread of its own, so that a
+   slow consumer does not keep the master from handing out jobs.
+   Records accumulate in a bounded buffer and are written out in
+   batches; only once the buffer is full does push() block until
+   the writer catches up. */
+class OutputWriter
+{
+    struct State
+    {
+        std::string buffer;
+        bool done = false;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup, drained;
+    const size_t maxBuffered;
+    std::thread thread;
+
+    /* Backpressure statistics, for the master's thread only. */
+    size_t bytes = 0;
+    size_t stalls = 0;
+    std::chrono::steady_clock::duration stallTime{0};
+    size_t highWater = 0;
+
+    /* Protected by state_. */
+    size_t writes = 0;
+
+    void run()
+    {
+        std::string batch;
+
+        while (true) {
+            {
+                auto state(state_.lock());
+                while (state->buffer.empty() && !state->done)
+                    state.wait(wakeup);
+                if (state->buffer.empty()) return;
+                std::swap(batch, state->buffer);
+                writes++;
+            }
+            drained.notify_one();
+
+            try {
+                writeFull(STDOUT_FILENO, batch, false);
+            } catch (...) {
+                auto state(state_.lock());
+                state->exc = std::current_exception();
+                state->done = true;
+                drained.notify_one();
+                return;
+            }
+
+            batch.clear();
+        }
+    }
+
+public:
+
+    OutputWriter(size_t maxBuffered)
+        : maxBuffered(maxBuffered)
+        , thread([this]() { run(); })
+    { }
+
+    ~OutputWriter()
+    {
+        {
+            auto state(state_.lock());
+            state->done = true;
+        }
+        wakeup.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+    /* Queue `record', followed by a newline in JSON lines or else
+       preceded by its length. */
+    void push(std::string_view record)
+    {
+        {
+            auto state(state_.lock());
+
+            if (!state->buffer.empty() && state->buffer.size() + record.size() >= maxBuffered) {
+                auto before = std::chrono::steady_clock::now();
+                stalls++;
+                while (!state->exc && !state->buffer.empty() && state->buffer.size() + record.size() >= maxBuffered)
+                    state.wait(drained);
+                stallTime += std::chrono::steady_clock::now() - before;
+            }
+
+            if (state->exc) std::rethrow_exception(state->exc);
+
+            auto size = state->buffer.size();
+
+            if (myArgs.outputFormat == OutputFormat::Json) {
+                state->buffer.append(record);
+                state->buffer.push_back('\n');
+            } else {
+                uint32_t length = record.size();
+                for (int shift = 24; shift >= 0; shift -= 8)
+                    state->buffer.push_back((char) (length >> shift));
+                state->buffer.append(record);
+            }
+            highWater = std::max(highWater, state->buffer.size());
+            bytes += state->buffer.size() - size;
+        }
+
+        wakeup.notify_one();
+    }
+
+    /* How long push() blocked so far. */
+    std::chrono::steady_clock::duration stalled() const
+    {
+        return stallTime;
+    }
+
+    /* Write out everything still buffered and stop the writer. */
+    void finish()
+    {
+        {
+            auto state(state_.lock());
+            state->done = true;
+        }
+        wakeup.notify_one();
+        thread.join();
+
+        auto state(state_.lock());
+        if (state->exc) std::rethrow_exception(state->exc);
+
+        printMsg(lvlTalkative, "wrote %d bytes of output in %d writes, at most %d bytes buffered, stalled %d times for %.3f s",
+            bytes, writes, highWater, stalls,
+            std::chrono::duration<double>(stallTime).count());
+    }
+};
+
+/* The time and memory the evaluation of a job took. */
+struct JobCost
+{
+    double time = 0;
+    size_t memory = 0;
+};
+
+/* The costs of the jobs of previous runs, which are used to hand out
+   the most expensive jobs first, so that they do not end up
+   dominating the total evaluation time by starting last. Without a
+   path, nothing is recorded and the jobs keep their alphabetical
+   order. */
+class CostDb
+{
+    Path path;
+    std::map<std::string, JobCost> costs;
+
+    /* The time of every job plus that of all jobs below it. */
+    std::map<std::string, double> priorities;
+
+public:
+
+    CostDb(const Path & path) : path(path)
+    {
+        if (path == "" || !pathExists(path)) return;
+
+        try {
+            auto json = nlohmann::json::parse(readFile(path));
+            for (auto & [attrPath, cost] : json.items())
+                costs[attrPath] = JobCost {
+                    .time = cost["time"],
+                    .memory = cost["memory"],
+                };
+        } catch (std::exception & e) {
+            warn("ignoring invalid cost file '%s': %s", path, e.what());
+            costs.clear();
+        }
+
+        /* A nested attribute set itself is cheap to evaluate, but we
+           want to discover the expensive jobs below it early. */
+        for (auto & [attrPath, cost] : costs) {
+            std::string prefix;
+            for (auto & name : splitAttrPath(attrPath)) {
+                prefix = appendAttrPath(prefix, name);
+                priorities[prefix] += cost.time;
+            }
+        }
+    }
+
+    double priority(const std::string & attrPath) const
+    {
+        auto i = priorities.find(attrPath);
+        return i == priorities.end() ? 0 : i->second;
+    }
+
+    void record(const std::string & attrPath, const JobCost & cost)
+    {
+        costs[attrPath] = cost;
+    }
+
+    void save()
+    {
+        if (path == "") return;
+
+        nlohmann::json json = nlohmann::json::object();
+        for (auto & [attrPath, cost] : costs)
+            json[attrPath] = { {"time", cost.time}, {"memory", cost.memory} };
+
+        createDirs(dirOf(path));
+        auto tmp = path + ".tmp";
+        writeFile(tmp, json.dump());
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    }
+};
+
+/* The group of jobs that `attrPath' belongs to. Jobs of a group
+   likely share evaluated values, so it pays to hand them to the same
+   worker. By default, that is the jobs with the same parent, and a
+   top-level job together with its children. With --affinity-key, it
+   is the first match of the regular expression, or of its first
+   group if it has one. */
+static std::string affinityKey(const std::string & attrPath)
+{
+    if (myArgs.affinityKey) {
+        std::smatch match;
+        if (std::regex_search(attrPath, match, *myArgs.affinityKey))
+            return match.size() > 1 ? match[1].str() : match[0].str();
+    }
+
+    auto names = splitAttrPath(attrPath);
+    if (names.size() > 1) names.pop_back();
+
+    std::string key;
+    for (auto & name : names)
+        key = appendAttrPath(key, name);
+    return key;
+}
+
+/* The jobs waiting to be handed out, most expensive first. Jobs
+   without a known cost keep their alphabetical order. */
+class JobQueue
+{
+    struct Job
+    {
+        double priority;
+        std::string attrPath;
+        std::string key;
+
+        bool operator < (const Job & other) const
+        {
+            return priority != other.priority
+                ? priority > other.priority
+                : attrPath < other.attrPath;
+        }
+    };
+
+    const CostDb & costs;
+    std::set<Job> jobs;
+
+    /* The same jobs by affinity key. */
+    std::map<std::string, std::set<Job>> groups;
+
+public:
+
+    JobQueue(const CostDb & costs) : costs(costs) { }
+
+    void push(const std::string & attrPath)
+    {
+        Job job { costs.priority(attrPath), attrPath, affinityKey(attrPath) };
+        groups[job.key].insert(job);
+        jobs.insert(std::move(job));
+    }
+
+    /* Take the most expensive job, preferring the ones with the
+       affinity key `key', which is set to the key of the job
+       taken. */
+    std::string pop(std::string & key)
+    {
+        auto group = groups.find(key);
+        auto job = group != groups.end() ? *group->second.begin() : *jobs.begin();
 
+        jobs.erase(job);
+        group = groups.find(job.key);
+        group->second.erase(job);
+        if (group->second.empty()) groups.erase(group);
+
+        key = job.key;
+        return job.attrPath;
+    }
+
+    bool empty() const
+    {
+        return jobs.empty();
+    }
+
+    size_t size() const
+    {
+        return jobs.size();
+    }
+};
+
+/* The results of the jobs of previous runs. Since flakes are
+   evaluated purely, a job of a flake with the same lock, evaluated
+   with the same options, yields the same results again; those are
+   replayed instead of evaluating the job. */
+class ResultCache
+{
+    SQLite db;
+    SQLiteStmt queryJob, insertJob;
+    std::unique_ptr<SQLiteTxn> txn;
+
+    /* The cache is shared by all runs of the user, so commit every
+       so many jobs rather than keeping concurrent runs waiting for
+       the end of this one. */
+    static constexpr size_t batchSize = 1000;
+    size_t uncommitted = 0;
+
+    /* Identifies the flake lock and everything else that affects the
+       results of a job besides its attribute path. */
+    std::string inputs;
+
+    std::string key(const std::string & attrPath)
+    {
+        return hashString(htSHA256, inputs + attrPath).to_string(Base32, false);
+    }
+
+public:
+
+    struct Entry
+    {
+        std::vector<std::string> records;
+        std::vector<std::string> drvPaths;
+        std::vector<std::string> children;
+    };
+
+    ResultCache(const std::string & inputs) : inputs(inputs)
+    {
+        auto dbPath = getCacheDir() + "/nix-eval-jobs/results-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        db = SQLite(dbPath);
+        db.isCache();
+        db.exec(R"(
+            create table if not exists Jobs (
+                key       text primary key not null,
+                entry     text not null,
+                timestamp integer not null
+            );
+        )");
+
+        queryJob.create(db, "select entry from Jobs where key = ?");
+        insertJob.create(db, "insert or replace into Jobs(key, entry, timestamp) values (?, ?, ?)");
+
+        txn = std::make_unique<SQLiteTxn>(db);
+    }
+
+    std::optional<Entry> lookup(const std::string & attrPath)
+    {
+        auto use(queryJob.use()(key(attrPath)));
+        if (!use.next()) return std::nullopt;
+
+        auto json = nlohmann::json::parse(use.getStr(0));
+        auto records = json["records"].get<std::vector<std::string>>();
+        if (myArgs.outputFormat != OutputFormat::Json)
+            for (auto & record : records)
+                record = base64Decode(record);
+
+        return Entry {
+            .records = std::move(records),
+            .drvPaths = json["drvPaths"].get<std::vector<std::string>>(),
+            .children = json["children"].get<std::vector<std::string>>(),
+        };
+    }
+
+    void insert(const std::string & attrPath, const Entry & entry)
+    {
+        nlohmann::json json;
+        /* Records in the binary output formats are not valid JSON
+           strings. */
+        json["records"] = entry.records;
+        if (myArgs.outputFormat != OutputFormat::Json)
+            for (auto & record : json["records"])
+                record = base64Encode(record.get<std::string>());
+        json["drvPaths"] = entry.drvPaths;
+        json["children"] = entry.children;
+        insertJob.use()(key(attrPath))(json.dump())((int64_t) time(0)).exec();
+
+        if (++uncommitted >= batchSize) {
+            txn->commit();
+            txn = std::make_unique<SQLiteTxn>(db);
+            uncommitted = 0;
+        }
+    }
+
+    void finish()
+    {
+        txn->commit();
+        txn.reset();
+    }
+};
+
+/* Writes the results to a SQLite database for --output-db, with a
+   table for the derivations of the jobs, their outputs and meta
+   attributes each, and one for the evaluation errors. */
+class OutputDb
+{
+    SQLite db;
+    SQLiteStmt insertJob, insertOutput, insertMeta, insertError;
+    std::unique_ptr<SQLiteTxn> txn;
+
+    /* Commit after this many records, so that the inserts do not
+       each pay for a transaction of their own. */
+    static constexpr size_t batchSize = 1000;
+    size_t uncommitted = 0;
+
+public:
+
+    OutputDb(const Path & path)
+    {
+        db = SQLite(path);
+        db.exec(R"(
+            create table if not exists Jobs (
+                id      integer primary key autoincrement not null,
+                attr    text not null,
+                name    text,
+                system  text,
+                drvPath text
+            );
+
+            create index if not exists IndexJobsAttr on Jobs(attr);
+            create index if not exists IndexJobsDrvPath on Jobs(drvPath);
+
+            create table if not exists Outputs (
+                job  integer not null,
+                name text not null,
+                path text not null,
+                primary key (job, name),
+                foreign key (job) references Jobs(id) on delete cascade
+            );
+
+            create table if not exists Meta (
+                job   integer not null,
+                name  text not null,
+                value text not null, -- JSON
+                primary key (job, name),
+                foreign key (job) references Jobs(id) on delete cascade
+            );
+
+            create table if not exists Errors (
+                attr  text primary key not null,
+                error text not null
+            );
+
+            delete from Outputs;
+            delete from Meta;
+            delete from Jobs;
+            delete from Errors;
+        )");
+
+        insertJob.create(db, "insert into Jobs(attr, name, system, drvPath) values (?, ?, ?, ?)");
+        insertOutput.create(db, "insert or replace into Outputs(job, name, path) values (?, ?, ?)");
+        insertMeta.create(db, "insert or replace into Meta(job, name, value) values (?, ?, ?)");
+        insertError.create(db, "insert or replace into Errors(attr, error) values (?, ?)");
+
+        txn = std::make_unique<SQLiteTxn>(db);
+    }
+
+    void insert(std::string_view record)
+    {
+        auto json = decodeRecord(record);
+        std::string attr = json["attr"];
+
+        if (auto error = json.find("error"); error != json.end())
+            insertError.use()(attr)(error->get<std::string>()).exec();
+
+        else {
+            auto field = [&](const char * name)
+            {
+                auto i = json.find(name);
+                return i != json.end() ? i->get<std::string>() : "";
+            };
+
+            insertJob.use()
+                (attr)
+                (field("name"), json.count("name"))
+                (field("system"), json.count("system"))
+                (field("drvPath"), json.count("drvPath"))
+                .exec();
+
+            auto job = (int64_t) db.getLastInsertedRowId();
+
+            if (auto outputs = json.find("outputs"); outputs != json.end())
+                for (auto & i : outputs->items())
+                    insertOutput.use()(job)(i.key())(i.value().get<std::string>()).exec();
+
+            if (auto meta = json.find("meta"); meta != json.end())
+                for (auto & i : meta->items())
+                    insertMeta.use()(job)(i.key())(i.value().dump()).exec();
+        }
+
+        if (++uncommitted >= batchSize) {
+            txn->commit();
+            txn = std::make_unique<SQLiteTxn>(db);
+            uncommitted = 0;
+        }
+    }
+
+    void finish()
+    {
+        txn->commit();
+        txn.reset();
+    }
+};
+
+/* Everything on the command line that may affect the results of a
+   job, for the result cache. Options that only affect how the jobs
+   are scheduled are left out. */
+static std::string evaluationInputs(const Strings & args)
+{
+    static const std::map<std::string, size_t> ignored = {
+        {"--workers", 1},
+        {"--max-memory-size", 1},
+        {"--soft-memory-size", 1},
+        {"--max-batch-size", 1},
+        {"--affinity-key", 1},
+        {"--timeout-per-attr", 1},
+        {"--output-db", 1},
+        {"--force-gc", 0},
+        {"--cost-file", 1},
+        {"--gc-roots-dir", 1},
+        {"--result-cache", 0},
+        {"--show-trace", 0},
+        {"--verbose", 0},
+        {"-v", 0},
+        {"--quiet", 0},
+        {"--debug", 0},
+        {"--log-format", 1},
+    };
+
+    std::string inputs = settings.thisSystem.get() + '\0';
+
+    for (auto i = args.begin(); i != args.end(); ++i) {
+        auto j = ignored.find(*i);
+        if (j != ignored.end()) {
+            for (size_t n = 0; n < j->second && std::next(i) != args.end(); n++) ++i;
+            continue;
+        }
+        inputs += *i;
+        inputs += '\0';
+    }
+
+    return inputs;
+}
+
+int main(int argc, char * * argv)
+{
+    /* Prevent undeclared dependencies in the evaluation via
+       $NIX_PATH. */
+    unsetenv("NIX_PATH");
+
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        initGC();
+
+        auto args = argvToStrings(argc, argv);
+        myArgs.parseCmdline(args);
+
+        /* FIXME: The build hook in conjunction with import-from-derivation is causing "unexpected EOF" during eval */
+        settings.builders = "";
+
+        /* Prevent access to paths outside of the Nix search path and
+           to the environment. */
+        evalSettings.restrictEval = false;
+
+        /* When building a flake, use pure evaluation (no access to
+           'getEnv', 'currentSystem' etc. */
+        evalSettings.pureEval = myArgs.evalMode == evalAuto ? myArgs.flake : myArgs.evalMode == evalPure;
+
+        if (myArgs.releaseExpr == "") throw UsageError("no expression specified");
+
+        if (myArgs.gcRootsDir == "") printMsg(lvlError, "warning: `--gc-roots-dir' not specified");
+
+        if (myArgs.showTrace) {
+            loggerSettings.showTrace.assign(true);
+        }
+
+        CostDb costs(myArgs.costFile);
+
+        JobQueue todo(costs);
+
+        OutputWriter output(outputBufferSize);
+
+        std::optional<OutputDb> outputDb;
+        if (myArgs.outputDb != "")
+            outputDb.emplace(myArgs.outputDb);
+
+        /* Write out a result record. */
+        auto emit = [&](std::string_view record)
+        {
+            output.push(record);
+            if (outputDb)
+                outputDb->insert(record);
+        };
+
+        std::optional<ResultCache> resultCache;
+        std::shared_ptr<Store> store;
+
+        /* Queue a job, unless its results can be replayed from the
+           result cache. */
+        std::function<void(const std::string &)> enqueue = [&](const std::string & attrPath)
+        {
+            /* Don't even look at the jobs that are neither selected
+               nor lead to selected ones. */
+            if (selection(attrPath) == Selection::None) return;
+
+            if (resultCache) {
+                if (auto entry = resultCache->lookup(attrPath)) {
+                    /* The derivations may have been garbage-collected
+                       since. */
+                    bool valid = true;
+                    for (auto & drvPath : entry->drvPaths)
+                        valid = valid && store->isValidPath(store->parseStorePath(drvPath));
+
+                    if (valid) {
+                        debug("replaying job '%s' from the result cache", attrPath);
+                        for (auto & record : entry->records)
+                            emit(record);
+                        for (auto & drvPath : entry->drvPaths)
+                            addGcRoot(ref<Store>(store), myArgs.gcRootsDir, drvPath);
+                        for (auto & child : entry->children)
+                            enqueue(child);
+                        return;
+                    }
+                }
+            }
+
+            todo.push(attrPath);
+        };
+
+        /* Start the zygote that collects the initial attributes to
+           evaluate and forks the worker processes. Evaluation must
+           not happen in this process, lest it spawns a download
+           thread or opens a store database that the zygotes we fork
+           later would inherit. The zygote itself only forks workers
+           from its evaluated root if that is safe; see
+           canShareRoot(). */
+        Pid zygotePid;
+        AutoCloseFD zygoteSock;
+
+        auto startZygote = [&](std::function<void(AutoCloseFD &)> run)
+        {
+            /* The store we opened for the result cache may be a local
+               one, whose database the zygote must not inherit, so
+               close it while forking. */
+            bool reopenStore = (bool) store;
+            store.reset();
+
+            int zygoteFds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, zygoteFds) == -1)
+                throw SysError("creating zygote socket");
+            AutoCloseFD zygoteSide(zygoteFds[1]);
+            zygoteSock = AutoCloseFD(zygoteFds[0]);
+            closeOnExec(zygoteFds[0]);
+            closeOnExec(zygoteFds[1]);
+
+            zygotePid = startProcess(
+                [&]()
+                {
+                    debug("created zygote process %d", getpid());
+                    zygoteSock.close();
+                    run(zygoteSide);
+                },
+                ProcessOptions { .allowVfork = false });
+
+            if (reopenStore)
+                store = openStore();
+        };
+
+        startZygote(zygote);
+
+        /* The lock of the flake, for the workers of plainZygote(). */
+        nlohmann::json flakeLock;
+
+        /* The zygote first reports the locked flake. */
+        {
+            auto s = readLine(zygoteSock.get());
+            auto json = nlohmann::json::parse(s);
+
+            if (json.find("error") != json.end())
+                throw Error("locking the flake: %s", (std::string) json["error"]);
+
+            if (json.find("lock") != json.end())
+                flakeLock = json["lock"];
+
+            if (myArgs.resultCache) {
+                if (json.find("fingerprint") == json.end() || !evalSettings.pureEval)
+                    warn("the result cache is only used for flakes evaluated in pure mode");
+                else {
+                    resultCache.emplace((std::string) json["fingerprint"] + '\0' + evaluationInputs(args));
+                    store = openStore();
+                }
+            }
+        }
+
+        /* Then, once it has evaluated the root, the top-level
+           attributes. The attribute path of the root is empty, which
+           no job has, so that is where the result cache keeps
+           them. */
+        bool haveAttrs = false;
+
+        auto readAttrs = [&]()
+        {
+            auto s = readLine(zygoteSock.get());
+            auto json = nlohmann::json::parse(s);
+
+            if (json.find("error") != json.end()) {
+                throw Error("getting initial attributes: %s", (std::string) json["error"]);
+
+            } else if (json.find("attrs") != json.end()) {
+                if (!json["shareRoot"].get<bool>())
+                    startZygote([&](AutoCloseFD & sock) { plainZygote(sock, flakeLock); });
+
+                if (haveAttrs) return;
+                haveAttrs = true;
+
+                auto attrs = json["attrs"].get<std::vector<std::string>>();
+
+                if (resultCache)
+                    resultCache->insert("", ResultCache::Entry { .children = attrs });
+
+                for (auto & a : attrs)
+                    enqueue(a);
+
+            } else {
+                throw Error("expected object with \"error\" or \"attrs\", got: %s", s);
+
+            }
+        };
+
+        if (resultCache) {
+            if (auto entry = resultCache->lookup("")) {
+                haveAttrs = true;
+                for (auto & a : entry->children)
+                    enqueue(a);
+            }
+        }
+
+        /* If we know the top-level attributes already, we only need
+           the zygote once there is a job that is not cached. */
+        bool zygoteReady = false;
+
+        if (!haveAttrs) {
+            readAttrs();
+            zygoteReady = true;
+        }
+
+        /* A worker process as seen by the master. */
+        struct WorkerProcess
+        {
+            pid_t pid;
+            AutoCloseFD from, to;
+
+            /* Input received from the worker that does not form a
+               complete message yet. */
+            std::string pending;
+
+            /* Whether the worker asked for a job. */
+            bool idle = false;
+
+            /* The jobs the worker was given and has not finished yet,
+               in the order it evaluates them. */
+            std::deque<std::string> jobs;
+
+            /* When the worker started on the first of its jobs. */
+            std::chrono::steady_clock::time_point started;
+
+            /* The affinity key of the last job the worker was given.
+               Its values of that group are already evaluated. */
+            std::optional<std::string> affinity;
+
+            /* The results of the first of them so far, for the result
+               cache, and how many there were. */
+            ResultCache::Entry results;
+            uint64_t received = 0;
+        };
+
+        /* How long we waited for the zygote to fork workers. */
+        std::chrono::steady_clock::duration zygoteWait{0};
+
+        /* Ask the zygote for a new worker process talking to us over
+           a fresh pair of pipes. */
+        auto startWorker = [&]() -> WorkerProcess
+        {
+            auto before = std::chrono::steady_clock::now();
+
+            Pipe toPipe, fromPipe;
+            toPipe.create();
+            fromPipe.create();
+
+            WorkerProcess proc;
+            sendFds(zygoteSock.get(), {fromPipe.writeSide.get(), toPipe.readSide.get()});
+            proc.pid = std::stoi(readLine(zygoteSock.get()));
+            zygoteWait += std::chrono::steady_clock::now() - before;
+            proc.from = std::move(fromPipe.readSide);
+            proc.to = std::move(toPipe.writeSide);
+            return proc;
+        };
+
+        struct Slot
+        {
+            WorkerProcess current;
+
+            /* A worker started while the current one approaches its
+               memory limit, to take over as soon as it restarts. */
+            std::optional<WorkerProcess> standby;
+        };
+
+        std::vector<Slot> slots;
+
+        size_t active = 0;
+
+        /* Put the jobs of `proc' back into the queue. */
+        auto requeue = [&](WorkerProcess & proc)
+        {
+            for (auto & job : proc.jobs) {
+                todo.push(job);
+                active--;
+            }
+            proc.jobs.clear();
+        };
+
+        /* Replace the current worker of `slot', which exited, by its
+           standby worker or else a new one. */
+        auto replaceWorker = [&](Slot & slot)
+        {
+            if (slot.standby) {
+                slot.current = std::move(*slot.standby);
+                slot.standby = std::nullopt;
+            } else
+                slot.current = startWorker();
+        };
+
+        /* How often a worker died while evaluating a job. */
+        std::map<std::string, unsigned int> crashes;
+
+        /* The current worker of `slot' died without saying goodbye,
+           e.g. from a segfault or the OOM killer. Its job may well
+           succeed on a fresh worker, so retry it once, but report it
+           as failed if it takes a second worker down with it. */
+        auto workerDied = [&](Slot & slot)
+        {
+            auto & proc = slot.current;
+
+            if (proc.jobs.empty())
+                printError("worker process %d exited unexpectedly", proc.pid);
+
+            else {
+                auto job = proc.jobs.front();
+                proc.jobs.pop_front();
+                active--;
+
+                if (++crashes[job] < 2) {
+                    printError("worker process %d exited unexpectedly while evaluating '%s', retrying", proc.pid, job);
+                    todo.push(job);
+                } else {
+                    printError("worker process %d exited unexpectedly while evaluating '%s' again, giving up", proc.pid, job);
+                    auto reply = response(job);
+                    reply["error"] = "the worker process evaluating this job exited unexpectedly twice";
+                    emit(encodeRecord(reply));
+                }
+
+                requeue(proc);
+            }
+
+            replaceWorker(slot);
+        };
+
+        /* How many attribute path components the workers looked up,
+           and for how many of them they could reuse an attribute set
+           evaluated for an earlier job. */
+        uint64_t attrsEvaluated = 0;
+        uint64_t attrsMemoised = 0;
+
+        /* How many jobs went to a worker that was given a job of the
+           same group before. */
+        uint64_t dispatched = 0;
+        uint64_t affine = 0;
+
+        /* Handle a message received from the current worker of
+           `slot'. */
+        auto handleMessage = [&](Slot & slot, MessageType type, std::string_view payload)
+        {
+            auto & proc = slot.current;
+
+            switch (type) {
+
+            /* Results are already serialised by the worker exactly as
+               we would print them, so pass them through untouched. */
+            case MessageType::Result:
+                emit(payload);
+                proc.received++;
+                if (resultCache)
+                    proc.results.records.emplace_back(payload);
+                return;
+
+            /* Nested attribute sets come back as a list of child
+               attribute paths to evaluate. */
+            case MessageType::Children: {
+                auto response = nlohmann::json::parse(payload);
+                for (std::string c : response["children"]) {
+                    if (resultCache)
+                        proc.results.children.push_back(c);
+                    enqueue(c);
+                }
+                return;
+            }
+
+            case MessageType::Error:
+                throw Error("worker error: %s", std::string(payload));
+
+            case MessageType::JobDone: {
+                if (proc.jobs.empty())
+                    throw Error("worker process %d finished a job it was not given", proc.pid);
+                auto & job = proc.jobs.front();
+                auto done = nlohmann::json::parse(payload);
+                if (done["results"].get<uint64_t>() != proc.received)
+                    throw Error("worker process %d sent %d results for '%s', but reported %d",
+                        proc.pid, proc.received, job, done["results"].get<uint64_t>());
+                /* The jobs of other shards cost next to nothing here,
+                   which says nothing about what they cost in a run
+                   that evaluates them. */
+                if (inShard(job))
+                    costs.record(job, JobCost {
+                        .time = done["time"],
+                        .memory = done["memory"],
+                    });
+                attrsEvaluated += done["attrsEvaluated"].get<uint64_t>();
+                attrsMemoised += done["attrsMemoised"].get<uint64_t>();
+                if (resultCache && !done["failed"].get<bool>()) {
+                    proc.results.drvPaths = done["drvPaths"].get<std::vector<std::string>>();
+                    resultCache->insert(job, proc.results);
+                }
+                proc.results = {};
+                proc.received = 0;
+                proc.jobs.pop_front();
+                proc.started = std::chrono::steady_clock::now();
+                active--;
+                return;
+            }
+
+            case MessageType::Next:
+                proc.idle = true;
+                return;
+
+            case MessageType::Restart:
+                requeue(proc);
+                replaceWorker(slot);
+                return;
+
+            case MessageType::Standby:
+                if (!slot.standby)
+                    slot.standby = startWorker();
+                return;
+
+            default:
+                throw Error("unexpected message of type %d from worker process %d", (int) type, proc.pid);
+            }
+        };
+
+        /* While we are blocked on a slow consumer of the output or on
+           the zygote, the workers cannot get their results to us and
+           wait as well. That time does not count towards their
+           timeouts, so move the start of their jobs forward by
+           however long we were blocked since the last call. */
+        std::chrono::steady_clock::duration excused{0};
+
+        auto excuseStalls = [&]()
+        {
+            auto stalled = output.stalled() + zygoteWait;
+            for (auto & slot : slots)
+                slot.current.started += stalled - excused;
+            excused = stalled;
+        };
+
+        std::vector<struct pollfd> fds;
+
+        while (true) {
+            checkInterrupt();
+
+            /* Start the workers once there is something to do. */
+            if (slots.empty() && !todo.empty()) {
+                if (!zygoteReady) {
+                    readAttrs();
+                    zygoteReady = true;
+                }
+                for (size_t i = 0; i < myArgs.nrWorkers; i++)
+                    slots.push_back(Slot { .current = startWorker() });
+            }
+
+            /* Hand out batches of jobs to the idle workers. Batches
+               save round-trips on many small jobs, but shrink to
+               single jobs as the queue runs empty, so that no worker
+               sits on a batch while the others are idle. */
+            for (auto & slot : slots) {
+                auto & proc = slot.current;
+                if (!proc.idle || todo.empty()) continue;
+                auto batchSize = std::clamp(todo.size() / (4 * slots.size()), (size_t) 1, myArgs.maxBatchSize);
+                std::vector<std::string> batch;
+                while (batch.size() < batchSize && !todo.empty()) {
+                    auto key = proc.affinity.value_or("");
+                    batch.push_back(todo.pop(key));
+                    if (proc.affinity == key) affine++;
+                    proc.affinity = key;
+                }
+                proc.idle = false;
+                proc.started = std::chrono::steady_clock::now();
+                proc.jobs.insert(proc.jobs.end(), batch.begin(), batch.end());
+                active += batch.size();
+                dispatched += batch.size();
+                try {
+                    writeMessage(proc.to.get(), MessageType::Do, nlohmann::json(batch).dump());
+                } catch (SysError & e) {
+                    /* The worker died, which we notice when reading
+                       from it. */
+                    if (e.errNo != EPIPE) throw;
+                }
+            }
+
+            if (todo.empty() && !active) break;
+
+            /* Wait for any of the workers to say something, or for
+               the first job to time out. */
+            fds.clear();
+            for (auto & slot : slots)
+                fds.push_back({ .fd = slot.current.from.get(), .events = POLLIN });
+
+            int timeout = -1;
+            if (myArgs.timeoutPerAttr) {
+                excuseStalls();
+                auto now = std::chrono::steady_clock::now();
+                for (auto & slot : slots) {
+                    if (slot.current.jobs.empty()) continue;
+                    int left = std::max<int64_t>(0, std::chrono::ceil<std::chrono::milliseconds>(
+                        slot.current.started + std::chrono::seconds(myArgs.timeoutPerAttr) - now).count());
+                    timeout = timeout == -1 ? left : std::min(timeout, left);
+                }
+            }
+
+            if (poll(fds.data(), fds.size(), timeout) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("polling worker processes");
+            }
+
+            for (size_t i = 0; i < slots.size(); i++) {
+                if (!fds[i].revents) continue;
+
+                auto & slot = slots[i];
+                auto pid = slot.current.pid;
+                auto & pending = slot.current.pending;
+
+                /* Read at least the rest of the message we are in the
+                   middle of, so that large results take few reads. */
+                size_t wanted = 65536;
+                if (pending.size() >= messageHeaderSize) {
+                    auto header = parseMessageHeader(pending.data());
+                    wanted = std::max(wanted, messageHeaderSize + header.length - pending.size());
+                }
+
+                auto oldSize = pending.size();
+                pending.resize(oldSize + wanted);
+                ssize_t n = read(slot.current.from.get(), pending.data() + oldSize, wanted);
+                pending.resize(oldSize + std::max(n, (ssize_t) 0));
+                if (n == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("reading from worker process %d", pid);
+                }
+                if (n == 0) {
+                    workerDied(slot);
+                    continue;
+                }
+
+                /* Process the complete messages. Once handleMessage()
+                   has replaced a restarting worker, the rest is not
+                   ours to process anymore. */
+                size_t start = 0;
+                while (pending.size() - start >= messageHeaderSize) {
+                    auto header = parseMessageHeader(pending.data() + start);
+                    if (pending.size() - start - messageHeaderSize < header.length) break;
+                    std::string_view payload(pending.data() + start + messageHeaderSize, header.length);
+                    start += messageHeaderSize + header.length;
+                    handleMessage(slot, header.type, payload);
+                    if (slot.current.pid != pid) break;
+                }
+                if (slot.current.pid == pid)
+                    pending.erase(0, start);
+            }
+
+            /* Kill the workers that took too long for a job, report
+               the job as failed and hand the rest of the batch to the
+               replacement. */
+            if (myArgs.timeoutPerAttr) {
+                excuseStalls();
+                auto now = std::chrono::steady_clock::now();
+                for (auto & slot : slots) {
+                    auto & proc = slot.current;
+                    if (proc.jobs.empty()
+                        || now - proc.started < std::chrono::seconds(myArgs.timeoutPerAttr))
+                        continue;
+
+                    auto & job = proc.jobs.front();
+                    printError("worker process %d took longer than %d seconds to evaluate '%s', killing it",
+                        proc.pid, myArgs.timeoutPerAttr, job);
+
+                    if (kill(proc.pid, SIGKILL) == -1 && errno != ESRCH)
+                        throw SysError("killing worker process %d", proc.pid);
+
+                    auto reply = response(job);
+                    reply["error"] = fmt("evaluation timed out after %d seconds", myArgs.timeoutPerAttr);
+                    emit(encodeRecord(reply));
+
+                    costs.record(job, JobCost {
+                        .time = (double) myArgs.timeoutPerAttr,
+                        .memory = 0,
+                    });
+
+                    proc.jobs.pop_front();
+                    active--;
+                    requeue(proc);
+
+                    replaceWorker(slot);
+                }
+            }
+        }
+
+        output.finish();
+
+        if (outputDb)
+            outputDb->finish();
+
+        printMsg(lvlTalkative, "looked up %d attribute path components in workers, %d of them memoised from earlier jobs",
+            attrsEvaluated + attrsMemoised, attrsMemoised);
+        printMsg(lvlTalkative, "handed %d of %d jobs to a worker that had a job of the same group before",
+            affine, dispatched);
+
+        if (resultCache)
+            resultCache->finish();
+
+        try {
+            costs.save();
+        } catch (Error & e) {
+            warn("could not save job costs: %s", e.msg());
+        }
+
+        /* A worker may have asked to be restarted and exited after
+           its last job, without us reading that yet. */
+        auto sendExit = [](WorkerProcess & proc)
+        {
+            try {
+                writeMessage(proc.to.get(), MessageType::Exit);
+            } catch (SysError & e) {
+                if (e.errNo != EPIPE) throw;
+            }
+        };
+
+        for (auto & slot : slots) {
+            sendExit(slot.current);
+            if (slot.standby)
+                sendExit(*slot.standby);
+        }
     });
 }
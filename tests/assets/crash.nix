@@ -0,0 +1,11 @@
+let
+  inherit (import ./lib.nix) mkJob;
+
+  # Recurses until the evaluator runs out of stack, which makes the
+  # worker exit on the spot instead of reporting an error.
+  overflow = n: 1 + overflow (n + 1);
+in
+{
+  fine = mkJob "fine";
+  crashing = builtins.seq (overflow 0) (mkJob "crashing");
+}
@@ -0,0 +1,20 @@
+let
+  inherit (import ./lib.nix) mkJob;
+in
+{
+  top = mkJob "top";
+  nested = {
+    a = mkJob "nested-a";
+    recursed = {
+      recurseForDerivations = true;
+      b = mkJob "nested-b";
+      # Not a job, and not callable with the auto arguments either.
+      buildSomething = { name, src }: mkJob name;
+      # Skipped for its name, like getDerivations() does.
+      "1skipped" = mkJob "nested-skipped";
+    };
+    ignored = {
+      c = mkJob "nested-c";
+    };
+  };
+}
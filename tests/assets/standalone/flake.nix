@@ -0,0 +1,22 @@
+# A flake without inputs, which the tests copy to change it or to
+# evaluate it without network access.
+{
+  outputs = { self }:
+    let
+      # builtins.currentSystem is not available in pure evaluation.
+      mkJob = name: derivation {
+        inherit name;
+        system = "x86_64-linux";
+        builder = "/bin/sh";
+        args = [ "-c" "echo ${name} > $out" ];
+      };
+    in
+    {
+      hydraJobs = {
+        first = mkJob "first";
+        nested = {
+          second = mkJob "second";
+        };
+      };
+    };
+}
@@ -1,41 +1,65 @@
 #!/usr/bin/env python3
 
+import os
+import shutil
 import subprocess
 import json
+import sqlite3
 from tempfile import TemporaryDirectory
 from pathlib import Path
-from typing import List
+from typing import Any, Dict, List, Optional
 
 TEST_ROOT = Path(__file__).parent.resolve()
 PROJECT_ROOT = TEST_ROOT.parent
 BIN = PROJECT_ROOT.joinpath("build", "src", "nix-eval-jobs")
 
 
-def common_test(extra_args: List[str]) -> None:
+def nix_eval_jobs_raw(
+    extra_args: List[str], cache_dir: Optional[Path] = None
+) -> bytes:
+    """Run nix-eval-jobs in the assets directory and return its output.
+
+    With cache_dir, the caches go there instead of ~/.cache."""
+    env = dict(os.environ)
+    if cache_dir is not None:
+        env["XDG_CACHE_HOME"] = str(cache_dir)
+
     with TemporaryDirectory() as tempdir:
-        cmd = [str(BIN), "--gc-roots-dir", tempdir, "--meta"] + extra_args
+        cmd = [str(BIN), "--gc-roots-dir", tempdir] + extra_args
         res = subprocess.run(
             cmd,
             cwd=TEST_ROOT.joinpath("assets"),
-            text=True,
+            env=env,
             check=True,
             stdout=subprocess.PIPE,
         )
 
-        results = [json.loads(r) for r in res.stdout.split("\n") if r]
-        assert len(results) == 2
+        return res.stdout
+
 
-        built_job = results[0]
-        assert built_job["attr"] == "builtJob"
-        assert built_job["name"] == "job1"
-        assert built_job["outputs"]["out"].startswith("/nix/store")
-        assert built_job["drvPath"].endswith(".drv")
-        assert built_job["meta"]['broken'] is False
+def nix_eval_jobs(
+    extra_args: List[str], cache_dir: Optional[Path] = None
+) -> List[Dict[str, Any]]:
+    """Like nix_eval_jobs_raw(), but return the JSON results."""
+    output = nix_eval_jobs_raw(extra_args, cache_dir).decode()
+    return [json.loads(r) for r in output.split("\n") if r]
+
+
+def common_test(extra_args: List[str]) -> None:
+    results = nix_eval_jobs(["--meta"] + extra_args)
+    assert len(results) == 2
 
-        substituted_job = results[1]
-        assert substituted_job["attr"] == "substitutedJob"
-        assert substituted_job["name"].startswith("hello-")
-        assert substituted_job["meta"]['broken'] is False
+    built_job = results[0]
+    assert built_job["attr"] == "builtJob"
+    assert built_job["name"] == "job1"
+    assert built_job["outputs"]["out"].startswith("/nix/store")
+    assert built_job["drvPath"].endswith(".drv")
+    assert built_job["meta"]['broken'] is False
+
+    substituted_job = results[1]
+    assert substituted_job["attr"] == "substitutedJob"
+    assert substituted_job["name"].startswith("hello-")
+    assert substituted_job["meta"]['broken'] is False
 
 
 def test_flake() -> None:
@@ -44,3 +68,152 @@ def test_flake() -> None:
 
 def test_expression() -> None:
     common_test(["ci.nix"])
+
+
+def test_nested() -> None:
+    results = nix_eval_jobs(["--workers", "2", "nested.nix"])
+    attrs = sorted(r["attr"] for r in results)
+    assert attrs == ["nested.a", "nested.recursed.b", "top"]
+
+
+def test_cost_file() -> None:
+    with TemporaryDirectory() as tempdir:
+        cost_file = Path(tempdir).joinpath("costs.json")
+        nix_eval_jobs(["--cost-file", str(cost_file), "nested.nix"])
+
+        costs = json.loads(cost_file.read_text())
+        assert "top" in costs
+        assert "nested.recursed.b" in costs
+        assert costs["top"]["time"] >= 0
+
+
+def test_shard() -> None:
+    attrs = []
+    for i in range(1, 4):
+        attrs += [r["attr"] for r in nix_eval_jobs(["--shard", f"{i}/3", "nested.nix"])]
+
+    assert sorted(attrs) == ["nested.a", "nested.recursed.b", "top"]
+
+
+def test_attr_selection() -> None:
+    results = nix_eval_jobs([
+        "--include-attr", "nested.*",
+        "--exclude-attr", "nested.a",
+        "nested.nix",
+    ])
+    attrs = sorted(r["attr"] for r in results)
+    assert attrs == ["nested.ignored.c", "nested.recursed.b"]
+
+
+def test_fields() -> None:
+    results = nix_eval_jobs(["--fields", "drvPath", "nested.nix"])
+    assert len(results) == 3
+    for result in results:
+        assert sorted(result.keys()) == ["attr", "drvPath"]
+
+
+def test_output_db() -> None:
+    with TemporaryDirectory() as tempdir:
+        db = Path(tempdir).joinpath("results.sqlite")
+        nix_eval_jobs(["--output-db", str(db), "nested.nix"])
+
+        with sqlite3.connect(db) as conn:
+            attrs = [r[0] for r in conn.execute("select attr from Jobs order by attr")]
+            assert attrs == ["nested.a", "nested.recursed.b", "top"]
+            outputs = conn.execute("select count(*) from Outputs where name = 'out'").fetchone()
+            assert outputs == (3,)
+
+
+def test_output_format_cbor() -> None:
+    output = nix_eval_jobs_raw(["--output-format", "cbor", "nested.nix"])
+
+    # Each record is preceded by its length as a 32-bit big-endian
+    # integer, and the records take up the whole output.
+    records = []
+    offset = 0
+    while offset < len(output):
+        length = int.from_bytes(output[offset:offset + 4], "big")
+        offset += 4
+        records.append(output[offset:offset + length])
+        offset += length
+    assert offset == len(output)
+    assert len(records) == 3
+
+    for record in records:
+        # A CBOR map.
+        assert record[0] >> 5 == 5
+
+    try:
+        import cbor2
+    except ImportError:
+        return
+
+    attrs = sorted(cbor2.loads(r)["attr"] for r in records)
+    assert attrs == ["nested.a", "nested.recursed.b", "top"]
+
+
+def test_meta_keys() -> None:
+    results = nix_eval_jobs(["--meta-keys", "broken", "ci.nix"])
+    assert len(results) == 2
+    for result in results:
+        assert list(result["meta"].keys()) == ["broken"]
+
+
+def test_timeout_per_attr() -> None:
+    results = nix_eval_jobs(["--timeout-per-attr", "1", "timeout.nix"])
+    results = {r["attr"]: r for r in results}
+    assert sorted(results) == ["looping", "quick"]
+    assert "error" not in results["quick"]
+    assert "timed out" in results["looping"]["error"]
+
+
+def test_worker_crash() -> None:
+    results = nix_eval_jobs(["--workers", "2", "crash.nix"])
+    results = {r["attr"]: r for r in results}
+    assert sorted(results) == ["crashing", "fine"]
+    assert "error" not in results["fine"]
+    assert "exited unexpectedly twice" in results["crashing"]["error"]
+
+
+def test_result_cache() -> None:
+    with TemporaryDirectory() as tempdir:
+        cache_dir = Path(tempdir).joinpath("cache")
+        flake = Path(tempdir).joinpath("flake")
+        shutil.copytree(TEST_ROOT.joinpath("assets", "standalone"), flake)
+
+        args = ["--result-cache", "--flake", f"{flake}#hydraJobs"]
+        first = nix_eval_jobs(args, cache_dir)
+        assert sorted(r["attr"] for r in first) == ["first", "nested.second"]
+
+        db = cache_dir.joinpath("nix-eval-jobs", "results-v1.sqlite")
+        with sqlite3.connect(db) as conn:
+            assert conn.execute("select count(*) from Jobs").fetchone()[0] > 0
+
+        # Replayed from the cache.
+        assert nix_eval_jobs(args, cache_dir) == first
+
+        # Other options give other results.
+        results = nix_eval_jobs(["--fields", "drvPath"] + args, cache_dir)
+        for result in results:
+            assert sorted(result.keys()) == ["attr", "drvPath"]
+
+        # So does another revision of the flake.
+        flake_nix = flake.joinpath("flake.nix")
+        flake_nix.write_text(flake_nix.read_text().replace('"second"', '"changed"'))
+        results = {r["attr"]: r for r in nix_eval_jobs(args, cache_dir)}
+        assert results["nested.second"]["name"] == "changed"
+
+
+def test_eval_cache_lookup() -> None:
+    with TemporaryDirectory() as tempdir:
+        cache_dir = Path(tempdir).joinpath("cache")
+        flake = Path(tempdir).joinpath("flake")
+        shutil.copytree(TEST_ROOT.joinpath("assets", "standalone"), flake)
+
+        args = ["--eval-cache-lookup", "--meta", "--flake", f"{flake}#hydraJobs"]
+        first = nix_eval_jobs(args, cache_dir)
+        assert sorted(r["attr"] for r in first) == ["first", "nested.second"]
+        assert list(cache_dir.joinpath("nix").glob("eval-cache-*/*.sqlite"))
+
+        # Taken from the cache this time.
+        assert nix_eval_jobs(args, cache_dir) == first